@@ -14,10 +14,13 @@ from esphome.components.ble_adv_handler import (
     validate_ble_adv_device,
 )
 from .const import (
+    CONF_BLE_ADV_COALESCING_WINDOW,
     CONF_BLE_ADV_CONTROLLER_ID,
     CONF_BLE_ADV_MAX_DURATION,
+    CONF_BLE_ADV_MERGE_DIM_CCT,
     CONF_BLE_ADV_SEQ_DURATION,
     CONF_BLE_ADV_SHOW_CONFIG,
+    CONF_BLE_ADV_WEIGHT,
 )
 
 AUTO_LOAD = ["ble_adv_handler"]
@@ -33,6 +36,11 @@ ENTITY_BASE_CONFIG_SCHEMA = cv.Schema(
     }
 )
 
+def validate_merge_dim_cct(config):
+    if config[CONF_BLE_ADV_MERGE_DIM_CCT] and config[CONF_BLE_ADV_COALESCING_WINDOW] == 0:
+        raise cv.Invalid(f"'{CONF_BLE_ADV_MERGE_DIM_CCT}' requires a '{CONF_BLE_ADV_COALESCING_WINDOW}'")
+    return config
+
 CONFIG_SCHEMA = cv.All(
     DEVICE_BASE_CONFIG_SCHEMA.extend(
     {
@@ -42,8 +50,12 @@ CONFIG_SCHEMA = cv.All(
         cv.Optional(CONF_BLE_ADV_SEQ_DURATION, default=100): cv.All(cv.positive_int, cv.Range(min=0, max=150)),
         cv.Optional(CONF_REVERSED, default=False): cv.boolean,
         cv.Optional(CONF_BLE_ADV_SHOW_CONFIG, default=True): cv.boolean,
+        cv.Optional(CONF_BLE_ADV_WEIGHT, default=1): cv.All(cv.positive_int, cv.Range(min=1, max=10)),
+        cv.Optional(CONF_BLE_ADV_COALESCING_WINDOW, default=0): cv.All(cv.positive_int, cv.Range(min=0, max=2000)),
+        cv.Optional(CONF_BLE_ADV_MERGE_DIM_CCT, default=False): cv.boolean,
     }),
     validate_ble_adv_device,
+    validate_merge_dim_cct,
 )
 
 async def entity_base_code_gen(var, config):
@@ -61,5 +73,8 @@ async def to_code(config):
     cg.add(var.set_seq_duration(config[CONF_BLE_ADV_SEQ_DURATION]))
     cg.add(var.set_reversed(config[CONF_REVERSED]))
     cg.add(var.set_show_config(config[CONF_BLE_ADV_SHOW_CONFIG]))
+    cg.add(var.set_weight(config[CONF_BLE_ADV_WEIGHT]))
+    cg.add(var.set_coalescing_window(config[CONF_BLE_ADV_COALESCING_WINDOW]))
+    cg.add(var.set_merge_dim_cct(config[CONF_BLE_ADV_MERGE_DIM_CCT]))
 
 
@@ -34,6 +34,11 @@ void BleAdvController::dump_config() {
   ESP_LOGCONFIG(TAG, "  Transmission Min Duration: %d ms", this->get_min_tx_duration());
   ESP_LOGCONFIG(TAG, "  Transmission Max Duration: %d ms", this->max_tx_duration_);
   ESP_LOGCONFIG(TAG, "  Transmission Sequencing Duration: %d ms", this->seq_duration_);
+  ESP_LOGCONFIG(TAG, "  Airtime Weight: %d", this->weight_);
+  if (this->coalescing_window_ > 0) {
+    ESP_LOGCONFIG(TAG, "  Coalescing Window: %d ms", this->coalescing_window_);
+    ESP_LOGCONFIG(TAG, "  Merge Brightness / Color Temperature: %s", this->merge_dim_cct_ ? "YES" : "NO");
+  }
   ESP_LOGCONFIG(TAG, "  Configuration visible: %s", this->show_config_ ? "YES" : "NO");
 }
 
@@ -55,18 +60,18 @@ void BleAdvController::on_cmd(float cmd_type, float param, float arg0, float arg
   enc_cmd.args[1] = (uint8_t)arg1;
   enc_cmd.args[2] = (uint8_t)arg2;
 
-  // enqueue a new CUSTOM command and encode the buffer(s)
-  this->commands_.emplace_back(CommandType::CUSTOM);
-  this->increase_counter();
-  for (auto encoder : this->encoders_) {
-    encoder->encode(this->commands_.back().params_, enc_cmd, this->params_);
-  }
+  // enqueue a new CUSTOM command, encoded when dequeued
+  QueueItem * item = this->add_command(CommandType::CUSTOM);
+  if (item == nullptr) return;
+  item->enc_cmd_ = enc_cmd;
+  this->get_parent()->schedule(this, millis());
 }
 
 void BleAdvController::on_raw_inject(std::string raw) {
-  this->commands_.emplace_back(CommandType::CUSTOM);
-  this->commands_.back().params_.emplace_back();
-  this->commands_.back().params_.back().from_hex_string(raw);
+  QueueItem * item = this->add_command(CommandType::CUSTOM);
+  if (item == nullptr) return;
+  item->raw_.from_hex_string(raw);
+  this->get_parent()->schedule(this, millis());
 }
 #endif
 
@@ -78,69 +83,181 @@ void BleAdvController::increase_counter() {
   this->params_.tx_count_++;
 }
 
+// New pending command of the given type, nullptr if it cannot be queued
+BleAdvController::QueueItem * BleAdvController::add_command(CommandType cmd_type) {
+  if (cmd_type == CommandType::CUSTOM) {
+    auto is_custom = [](QueueItem& q){ return q.gen_cmd_.cmd == CommandType::CUSTOM; };
+    if ((size_t)std::count_if(this->commands_.begin(), this->commands_.end(), is_custom) >= MAX_CUSTOM_COMMANDS) {
+      ESP_LOGW(TAG, "Too many pending custom commands (%zu), oldest one dropped", MAX_CUSTOM_COMMANDS);
+      this->commands_.erase(std::find_if(this->commands_.begin(), this->commands_.end(), is_custom));
+    }
+  }
+  QueueItem * item = this->commands_.emplace_back();
+  if (item == nullptr) {
+    ESP_LOGW(TAG, "Too many pending commands (%zu), command dropped", MAX_PENDING_COMMANDS);
+    return nullptr;
+  }
+  item->gen_cmd_.cmd = cmd_type;
+  return item;
+}
+
+// Commands of the same class are setting the same state: only the latest one is relevant
+CommandType BleAdvController::get_cmd_class(CommandType cmd_type) {
+  switch (cmd_type) {
+    case CommandType::LIGHT_OFF:
+      return CommandType::LIGHT_ON;
+    case CommandType::LIGHT_SEC_OFF:
+      return CommandType::LIGHT_SEC_ON;
+    default:
+      return cmd_type;
+  }
+}
+
 bool BleAdvController::enqueue(BleAdvGenCmd &gen_cmd) {
-  // Remove any previous command of the same type in the queue
-  uint8_t nb_rm = std::count_if(this->commands_.begin(), this->commands_.end(), [&](QueueItem& q){ return q.cmd_type_ == gen_cmd.cmd; });
-  if (nb_rm) {
-    ESP_LOGD(TAG, "Removing %d previous pending commands", nb_rm);
-    this->commands_.remove_if( [&](QueueItem& q){ return q.cmd_type_ == gen_cmd.cmd; } );
+  // Remove any previous command of the same type in the queue, or of the same class if coalescing
+  size_t nb_rm = 0;
+  if (this->coalescing_window_ > 0) {
+    CommandType cmd_class = get_cmd_class(gen_cmd.cmd);
+    nb_rm = this->commands_.remove_if( [&](QueueItem& q){ return get_cmd_class(q.gen_cmd_.cmd) == cmd_class; } );
+  } else {
+    nb_rm = this->commands_.remove_if( [&](QueueItem& q){ return q.gen_cmd_.cmd == gen_cmd.cmd; } );
   }
-  
-  // enqueue the new command and encode the buffer(s)
-  this->commands_.emplace_back(gen_cmd.cmd);
-  this->increase_counter();
-  for (auto & encoder : this->encoders_) {
-    std::vector< BleAdvEncCmd > enc_cmds;
-    encoder->translate_g2e(enc_cmds, gen_cmd);
-    for (auto & enc_cmd: enc_cmds) {
-      encoder->encode(this->commands_.back().params_, enc_cmd, this->params_);
-    }
+  // the log level checked first, the filtering of a DEBUG log at runtime allocating the tag lookup string
+  if (nb_rm && ble_adv_handler::log_enabled(ESPHOME_LOG_LEVEL_DEBUG)) {
+    ESP_LOGD(TAG, "Removing %zu previous pending commands", nb_rm);
   }
   
-  return !this->commands_.back().params_.empty();
-}
-
-void BleAdvController::loop() {
-  uint32_t now = millis();
-  if(this->adv_start_time_ == 0) {
-    // no on going command advertised by this controller, check if any to advertise
-    if(!this->commands_.empty()) {
-      QueueItem & item = this->commands_.front();
-      if (!item.params_.empty()) {
-        // setup seq duration for each packet
-        bool use_seq_duration = (this->seq_duration_ > 0) && (this->seq_duration_ < this->get_min_tx_duration());
-        for (auto & param : item.params_) {
-          param.duration_ = use_seq_duration ? this->seq_duration_: this->get_min_tx_duration();
+  // enqueue the new command, encoded when dequeued
+  QueueItem * item = this->add_command(gen_cmd.cmd);
+  if (item == nullptr) return false;
+  item->gen_cmd_ = gen_cmd;
+  // processed at the next tick of the timer wheel
+  this->get_parent()->schedule(this, millis());
+  
+  BleAdvEncCmd enc_cmd;
+  return std::any_of(this->encoders_.begin(), this->encoders_.end(), [&](ble_adv_handler::BleAdvEncoder * e){ return e->translate_g2e(enc_cmd, gen_cmd); });
+}
+
+void BleAdvController::on_timer(uint32_t now) {
+  if (this->advertising_) {
+    // command is being advertised by this controller, check if stop and clean-up needed
+    uint32_t duration = this->commands_.empty() ? this->max_tx_duration_ : this->get_min_tx_duration();
+    uint32_t stop_time = this->adv_start_time_ + duration;
+    if (this->has_superseding_command()) {
+      uint32_t airtime_left = this->get_parent()->get_min_airtime_left(this->adv_id_);
+      if (airtime_left == 0) {
+        if (ble_adv_handler::log_enabled(ESPHOME_LOG_LEVEL_DEBUG)) {
+          ESP_LOGD(TAG, "Command superseded - %d", this->adv_id_);
         }
-        this->adv_id_ = this->get_parent()->add_to_advertiser(item.params_);
-        this->adv_start_time_ = now;
+        stop_time = now;
+      } else if ((int32_t)(now + airtime_left - stop_time) < 0) {
+        // checked again once the airtime may have been reached
+        stop_time = now + airtime_left;
       }
-      this->commands_.pop_front();
     }
+    if ((int32_t)(now - stop_time) < 0) {
+      this->get_parent()->schedule(this, stop_time);
+      return;
+    }
+    this->advertising_ = false;
+    this->get_parent()->remove_from_advertiser(this->adv_id_);
   }
-  else {
-    // command is being advertised by this controller, check if stop and clean-up needed
-    uint32_t duration = this->commands_.empty() ? this->max_tx_duration_ : this->number_duration_.state;
-    if (now > this->adv_start_time_ + duration) {
-      this->adv_start_time_ = 0;
-      this->get_parent()->remove_from_advertiser(this->adv_id_);
+
+  // no on going command advertised by this controller, check if any to advertise
+  if (this->commands_.empty()) return;
+  if (this->coalescing_window_ > 0) {
+    // at most one command per window, the commands received in the meantime are coalesced
+    uint32_t window_end = this->adv_start_time_ + this->coalescing_window_;
+    if ((int32_t)(now - window_end) < 0) {
+      this->get_parent()->schedule(this, window_end);
+      return;
+    }
+    this->coalesce_commands();
+  }
+  QueueItem & item = this->commands_.front();
+  CommandType cmd_type = item.gen_cmd_.cmd;
+  this->adv_params_.clear();
+  if (item.raw_.get_full_len() > 0) {
+    *this->adv_params_.emplace_back() = std::move(item.raw_);
+  } else {
+    // encode the buffer(s)
+    this->increase_counter();
+    for (auto & encoder : this->encoders_) {
+      BleAdvEncCmd enc_cmd = item.enc_cmd_;
+      if ((cmd_type != CommandType::CUSTOM) && !encoder->translate_g2e(enc_cmd, item.gen_cmd_)) continue;
+      ble_adv_handler::BleAdvParam * param = this->adv_params_.emplace_back();
+      if (param == nullptr) break;
+      encoder->encode(*param, enc_cmd, this->params_);
     }
   }
+  this->commands_.pop_front();
+  if (this->adv_params_.empty()) {
+    this->get_parent()->schedule(this, now);
+    return;
+  }
+  // setup seq duration for each packet
+  bool use_seq_duration = (this->seq_duration_ > 0) && (this->seq_duration_ < this->get_min_tx_duration());
+  for (auto & param : this->adv_params_) {
+    param.duration_ = use_seq_duration ? this->seq_duration_: this->get_min_tx_duration();
+  }
+  ble_adv_handler::BleAdvSchedParam sched{cmd_type, this->get_min_tx_duration(), this->max_tx_duration_, this, this->weight_};
+  this->adv_id_ = this->get_parent()->add_to_advertiser(this->adv_params_, sched);
+  this->adv_cmd_type_ = cmd_type;
+  this->adv_start_time_ = now;
+  this->advertising_ = true;
+  this->get_parent()->schedule(this, now + (this->commands_.empty() ? this->max_tx_duration_ : this->get_min_tx_duration()));
+}
+
+// Merge the pending Brightness and Color Temperature commands into a single Cold / Warm command, if requested
+// and supported by all the encoders. Those commands are only sent by a light with 'separate_dim_cct', so the merge
+// is opt-in: the lamp must accept the Cold / Warm command. The levels are computed as by 'as_cwww' in the light.
+void BleAdvController::coalesce_commands() {
+  if (!this->merge_dim_cct_) return;
+  auto is_cmd = [&](CommandType cmd_type) { return [=](QueueItem& q){ return q.gen_cmd_.cmd == cmd_type; }; };
+  auto dim = std::find_if(this->commands_.begin(), this->commands_.end(), is_cmd(CommandType::LIGHT_DIM));
+  auto cct = std::find_if(this->commands_.begin(), this->commands_.end(), is_cmd(CommandType::LIGHT_CCT));
+  if ((dim == this->commands_.end()) || (cct == this->commands_.end())) return;
+
+  float brf = dim->gen_cmd_.args[0];
+  float ctf = cct->gen_cmd_.args[0];
+  // the brighter channel at full level, or the sum of both channels constant
+  float norm = this->constant_brightness_ ? 1.f : std::max(ctf, 1.f - ctf);
+  BleAdvGenCmd gen_cmd(CommandType::LIGHT_WCOLOR);
+  gen_cmd.args[0] = brf * (1.f - ctf) / norm;
+  gen_cmd.args[1] = brf * ctf / norm;
+
+  auto supports = [&](ble_adv_handler::BleAdvEncoder * e){ BleAdvEncCmd enc_cmd; return e->translate_g2e(enc_cmd, gen_cmd); };
+  if (!std::all_of(this->encoders_.begin(), this->encoders_.end(), supports)) return;
+
+  if (ble_adv_handler::log_enabled(ESPHOME_LOG_LEVEL_DEBUG)) {
+    ESP_LOGD(TAG, "Coalescing Brightness: %.0f%%, Warm Color: %.0f%%", brf*100, ctf*100);
+  }
+  // the merged command takes the place of the first one, the other one is removed
+  QueueItem & item = (dim < cct) ? *dim : *cct;
+  item.gen_cmd_ = gen_cmd;
+  this->commands_.remove_if(is_cmd((dim < cct) ? CommandType::LIGHT_CCT : CommandType::LIGHT_DIM));
+}
+
+// The command being advertised is made obsolete by a pending command of the same type,
+// it can be stopped as soon as it had its minimum effective airtime
+bool BleAdvController::has_superseding_command() {
+  if (this->adv_cmd_type_ == CommandType::CUSTOM) return false;
+  return std::any_of(this->commands_.begin(), this->commands_.end(), [&](QueueItem& q){ return q.gen_cmd_.cmd == this->adv_cmd_type_; });
 }
 
 void BleAdvEntity::dump_config_base(const char * tag) {
   ESP_LOGCONFIG(tag, "  Controller '%s'", this->get_parent()->get_name().c_str());
 }
 
-void BleAdvEntity::command(BleAdvGenCmd &gen_cmd) {
-  this->get_parent()->enqueue(gen_cmd);
+bool BleAdvEntity::command(BleAdvGenCmd &gen_cmd) {
+  return this->get_parent()->enqueue(gen_cmd);
 }
 
-void BleAdvEntity::command(CommandType cmd_type, float value1, float value2) {
+bool BleAdvEntity::command(CommandType cmd_type, float value1, float value2) {
   BleAdvGenCmd gen_cmd(cmd_type);
   gen_cmd.args[0] = value1;
   gen_cmd.args[1] = value2;
-  this->get_parent()->enqueue(gen_cmd);
+  return this->get_parent()->enqueue(gen_cmd);
 }
 
 } // namespace ble_adv_controller
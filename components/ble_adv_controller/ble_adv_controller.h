@@ -8,7 +8,6 @@
 #endif
 #include "esphome/components/ble_adv_handler/ble_adv_handler.h"
 #include <vector>
-#include <list>
 
 namespace esphome {
 namespace ble_adv_controller {
@@ -22,22 +21,27 @@ using BleAdvEncCmd = ble_adv_handler::BleAdvEncCmd;
     One physical device controlled == One Controller.
     Referenced by Entities as their parent to perform commands.
     Chooses which encoder(s) to be used to issue a command
-    Interacts with the BleAdvHandler for Queue processing
+    Interacts with the BleAdvHandler for Queue processing, woken by its timer wheel only when a deadline is reached
  */
-class BleAdvController : public Component, public ble_adv_handler::BleAdvDevice
+class BleAdvController : public Component, public ble_adv_handler::BleAdvDevice, public ble_adv_handler::BleAdvTimer
 #ifdef USE_API
   , public api::CustomAPIDevice
 #endif
 {
 public:
   void setup() override;
-  void loop() override;
+  void on_timer(uint32_t now) override;
   virtual void dump_config() override;
   
   void set_min_tx_duration(int tx_duration, int min, int max, int step);
   uint32_t get_min_tx_duration() { return (uint32_t)this->number_duration_.state; }
   void set_max_tx_duration(uint32_t tx_duration) { this->max_tx_duration_ = tx_duration; }
   void set_seq_duration(uint32_t seq_duration) { this->seq_duration_ = seq_duration; }
+  void set_weight(uint8_t weight) { this->weight_ = weight; }
+  void set_coalescing_window(uint32_t coalescing_window) { this->coalescing_window_ = coalescing_window; }
+  void set_merge_dim_cct(bool merge_dim_cct) { this->merge_dim_cct_ = merge_dim_cct; }
+  // from the light, for the merged cold / warm levels to be computed as by the light itself
+  void set_constant_brightness(bool constant_brightness) { this->constant_brightness_ = constant_brightness; }
   void set_reversed(bool reversed) { this->reversed_ = reversed; }
   bool is_reversed() const { return this->reversed_; }
   void set_show_config(bool show_config) { this->show_config_ = show_config; }
@@ -51,6 +55,7 @@ public:
   void on_raw_inject(std::string raw);
 #endif
 
+  // false if the command is not supported by any encoder, or could not be queued
   bool enqueue(BleAdvGenCmd & cmd);
 
 protected:
@@ -58,27 +63,41 @@ protected:
 
   uint32_t max_tx_duration_ = 3000;
   uint32_t seq_duration_ = 150;
+  uint8_t weight_ = 1;
+  uint32_t coalescing_window_ = 0;
+  bool merge_dim_cct_ = false;
+  bool constant_brightness_ = false;
 
   bool reversed_;
 
   bool show_config_{false};
   ble_adv_handler::BleAdvNumber number_duration_;
 
-  class QueueItem {
-  public:
-    QueueItem(CommandType cmd_type): cmd_type_(cmd_type) {}
-    CommandType cmd_type_;
-    std::vector< ble_adv_handler::BleAdvParam > params_;
-  
-    // Only move operators to avoid data copy
-    QueueItem(QueueItem&&) = default;
-    QueueItem& operator=(QueueItem&&) = default;
+  // Pending commands, only encoded when submitted to the advertiser:
+  // no heap allocation from the entity command to the packets queued for air.
+  // At most one command per type, the previous one being removed, plus the latest CUSTOM ones from the services.
+  static constexpr size_t MAX_CUSTOM_COMMANDS = 4;
+  static constexpr size_t MAX_PENDING_COMMANDS = ble_adv_handler::NB_COMMAND_TYPES + MAX_CUSTOM_COMMANDS;
+  struct QueueItem {
+    BleAdvGenCmd gen_cmd_;
+    // CUSTOM command from the services: encoded command, or raw packet if not empty
+    BleAdvEncCmd enc_cmd_;
+    ble_adv_handler::BleAdvParam raw_;
   };
-  std::list< QueueItem > commands_;
+  ble_adv_handler::FixedVector< QueueItem, MAX_PENDING_COMMANDS > commands_;
+  QueueItem * add_command(CommandType cmd_type);
+  static CommandType get_cmd_class(CommandType cmd_type);
+  void coalesce_commands();
+
+  // packets of the command submitted to the advertiser, one per encoder
+  ble_adv_handler::BleAdvParams adv_params_;
 
   // Being advertised data properties
+  bool advertising_ = false;
   uint32_t adv_start_time_ = 0;
   uint16_t adv_id_ = 0;
+  CommandType adv_cmd_type_ = CommandType::NOCMD;
+  bool has_superseding_command();
 };
 
 /**
@@ -92,8 +111,8 @@ class BleAdvEntity: public Component, public Parented < BleAdvController >
 
   protected:
     void dump_config_base(const char * tag);
-    void command(BleAdvGenCmd &gen_cmd);
-    void command(CommandType cmd, float value1 = 0, float value2 = 0);
+    bool command(BleAdvGenCmd &gen_cmd);
+    bool command(CommandType cmd, float value1 = 0, float value2 = 0);
 };
 
 } //namespace ble_adv_controller
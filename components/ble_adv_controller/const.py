@@ -8,3 +8,6 @@ CONF_BLE_ADV_MAX_DURATION = "max_duration"
 CONF_BLE_ADV_SEQ_DURATION = "seq_duration"
 CONF_BLE_ADV_SPLIT_DIM_CCT = "separate_dim_cct"
 CONF_BLE_ADV_FORCED_REFRESH_ON_START = "forced_refresh_on_start"
+CONF_BLE_ADV_WEIGHT = "weight"
+CONF_BLE_ADV_COALESCING_WINDOW = "coalescing_window"
+CONF_BLE_ADV_MERGE_DIM_CCT = "merge_dim_cct"
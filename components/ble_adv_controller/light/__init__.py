@@ -20,6 +20,7 @@ from .. import (
 )
 
 from ..const import (
+    CONF_BLE_ADV_CONTROLLER_ID,
     CONF_BLE_ADV_SECONDARY,
     CONF_BLE_ADV_SPLIT_DIM_CCT,
 )
@@ -65,5 +66,7 @@ async def to_code(config):
     else:
         cg.add(var.set_traits(config[CONF_COLD_WHITE_COLOR_TEMPERATURE], config[CONF_WARM_WHITE_COLOR_TEMPERATURE]))
         cg.add(var.set_constant_brightness(config[CONF_CONSTANT_BRIGHTNESS]))
+        controller = await cg.get_variable(config[CONF_BLE_ADV_CONTROLLER_ID])
+        cg.add(controller.set_constant_brightness(config[CONF_CONSTANT_BRIGHTNESS]))
         cg.add(var.set_split_dim_cct(config[CONF_BLE_ADV_SPLIT_DIM_CCT]))
         cg.add(var.set_min_brightness(config[CONF_MIN_BRIGHTNESS] * 100, 0, 100, 1))
@@ -12,6 +12,12 @@ from .const import (
     CONF_BLE_ADV_HANDLER_ID,
     CONF_BLE_ADV_ENCODING,
     CONF_BLE_ADV_FORCED_ID,
+    CONF_BLE_ADV_TRACE_SIZE,
+    CONF_BLE_ADV_MAX_PACKETS,
+    CONF_BLE_ADV_HOT_SWAP,
+    CONF_BLE_ADV_MAX_ADV_SETS,
+    CONF_BLE_ADV_CAPTURE_DEDUP_SIZE,
+    CONF_BLE_ADV_CAPTURE_QUEUE_SIZE,
 )
 
 AUTO_LOAD = ["esp32_ble", "select", "number"]
@@ -145,25 +151,82 @@ class TranslatorGenerator():
             cls.created[trans_class_name] = cg.RawExpression(inst_name)
         return cls.created[trans_class_name]
 
+    @classmethod
+    def g2e_exec(cls, conds):
+        exec_cmd = "".join([f"e.{attr} = {val}; " for (attr, val) in conds["e"].items()])
+        if "raw_g2e" in conds:
+            exec_cmd += conds["raw_g2e"]
+        return exec_cmd
+
+    @classmethod
+    def e2g_exec(cls, conds):
+        exec_cmd = " ".join([f"g.{attr} = {val};" for (attr, val) in conds["g"].items()])
+        if "raw_e2g" in conds:
+            exec_cmd += conds["raw_e2g"]
+        return exec_cmd
+
+    @classmethod
+    def ordered_ifs(cls, translators, side, checked, exec_fn, indent):
+        # translators in their original order, as a later match overwrites the previous ones
+        # conditions already checked by the enclosing switches are skipped
+        code = ""
+        for conds in translators:
+            if_cond = " && ".join([f"({side}.{attr} == {val})" for (attr, val) in conds[side].items() if attr not in checked])
+            exec_cmd = exec_fn(conds)
+            code += f"\n{indent}if ({if_cond}) {{ {exec_cmd} }}" if if_cond else f"\n{indent}{{ {exec_cmd} }}"
+        return code
+
     @classmethod 
     def define_class(cls, name, translators):
-        cl = f"class {name}: public {CommandTranslator}\n{{"
+        cl = f"class {name} final: public {CommandTranslator}\n{{"
         cl += f"\npublic:"
-        cl += f"\n  void g2e_cmd(const {BleAdvGenCmd} & g, {BleAdvEncCmd} & e) const override {{"
+
+        # g2e: switch on cmd, then on param for the cmds having translators depending on it
+        # translators not depending on param are valid for any param value
+        g2e_groups = {}
         for conds in translators:
-            if_cond = " && ".join([f"(g.{attr} == {val})" for (attr, val) in conds["g"].items()])
-            exec_cmd = "".join([f"e.{attr} = {val}; " for (attr, val) in conds["e"].items()])
-            if "raw_g2e" in conds:
-                exec_cmd += conds["raw_g2e"]
-            cl += f"\n    if ({if_cond}) {{ {exec_cmd} }}"
+            g2e_groups.setdefault(str(conds["g"]["cmd"]), []).append(conds)
+        cl += f"\n  void g2e_cmd(const {BleAdvGenCmd} & g, {BleAdvEncCmd} & e) const override {{"
+        cl += f"\n    switch (g.cmd) {{"
+        for (cmd, group) in g2e_groups.items():
+            cl += f"\n    case {cmd}:"
+            params = list(dict.fromkeys([str(conds["g"]["param"]) for conds in group if "param" in conds["g"]]))
+            if not params:
+                cl += cls.ordered_ifs(group, "g", ["cmd"], cls.g2e_exec, " " * 6)
+            else:
+                cl += f"\n      switch (g.param) {{"
+                for param in params:
+                    cl += f"\n      case {param}:"
+                    param_group = [conds for conds in group if str(conds["g"].get("param", param)) == param]
+                    cl += cls.ordered_ifs(param_group, "g", ["cmd", "param"], cls.g2e_exec, " " * 8)
+                    cl += f"\n        break;"
+                cl += f"\n      default:"
+                cl += cls.ordered_ifs([conds for conds in group if "param" not in conds["g"]], "g", ["cmd"], cls.g2e_exec, " " * 8)
+                cl += f"\n        break;"
+                cl += f"\n      }}"
+            cl += f"\n      break;"
+        cl += f"\n    default:"
+        cl += f"\n      break;"
+        cl += f"\n    }}"
         cl += f"\n  }}" # end of g2e
-        cl += f"\n  void e2g_cmd(const {BleAdvEncCmd} & e, {BleAdvGenCmd} & g) const override {{"
+
+        # e2g: index of the translators group for each encoded cmd byte, 0 if none
+        e2g_groups = {}
         for conds in translators:
-            if_cond = " && ".join([f"(e.{attr} == {val})" for (attr, val) in conds["e"].items()])
-            exec_cmd = " ".join([f"g.{attr} = {val};" for (attr, val) in conds["g"].items()])
-            if "raw_e2g" in conds:
-                exec_cmd += conds["raw_e2g"]
-            cl += f"\n    if ({if_cond}) {{ {exec_cmd} }}"
+            e2g_groups.setdefault(conds["e"]["cmd"], []).append(conds)
+        e2g_index = [0] * 256
+        for (group_id, cmd) in enumerate(e2g_groups.keys(), 1):
+            e2g_index[cmd] = group_id
+        cl += f"\n  void e2g_cmd(const {BleAdvEncCmd} & e, {BleAdvGenCmd} & g) const override {{"
+        cl += f"\n    static constexpr uint8_t E2G_INDEX[256] = {{ {', '.join([str(x) for x in e2g_index])} }};"
+        cl += f"\n    switch (E2G_INDEX[e.cmd]) {{"
+        for (group_id, group) in enumerate(e2g_groups.values(), 1):
+            cl += f"\n    case {group_id}:"
+            cl += cls.ordered_ifs(group, "e", ["cmd"], cls.e2g_exec, " " * 6)
+            cl += f"\n      break;"
+        cl += f"\n    default:"
+        cl += f"\n      break;"
+        cl += f"\n    }}"
         cl += f"\n  }}" # end of e2g
         cl += f"\n}}"
         cg.add(cg.RawExpression(cl))
@@ -395,6 +458,12 @@ CONFIG_SCHEMA = cv.All(
     cv.Schema(
     {
         cv.GenerateID(): cv.declare_id(BleAdvHandler),
+        cv.Optional(CONF_BLE_ADV_TRACE_SIZE, default=0): cv.All(cv.positive_int, cv.Range(min=0, max=256)),
+        cv.Optional(CONF_BLE_ADV_MAX_PACKETS, default=16): cv.All(cv.positive_int, cv.Range(min=1, max=128)),
+        cv.Optional(CONF_BLE_ADV_HOT_SWAP, default=True): cv.boolean,
+        cv.Optional(CONF_BLE_ADV_MAX_ADV_SETS, default=1): cv.All(cv.positive_int, cv.Range(min=1, max=10)),
+        cv.Optional(CONF_BLE_ADV_CAPTURE_DEDUP_SIZE, default=64): cv.All(cv.positive_int, cv.Range(min=4, max=1024)),
+        cv.Optional(CONF_BLE_ADV_CAPTURE_QUEUE_SIZE, default=16): cv.All(cv.positive_int, cv.Range(min=1, max=256)),
     }),
     cv.only_on([PLATFORM_ESP32]),
 )
@@ -403,6 +472,13 @@ async def to_code(config):
     var = cg.new_Pvariable(config[CONF_ID])
     cg.add(var.set_setup_priority(300)) # start after Bluetooth
     await cg.register_component(var, config)
+    cg.add(var.set_max_packets(config[CONF_BLE_ADV_MAX_PACKETS]))
+    cg.add(var.set_hot_swap(config[CONF_BLE_ADV_HOT_SWAP]))
+    cg.add(var.set_max_adv_sets(config[CONF_BLE_ADV_MAX_ADV_SETS]))
+    cg.add(var.set_capture_dedup_size(config[CONF_BLE_ADV_CAPTURE_DEDUP_SIZE]))
+    cg.add(var.set_capture_queue_size(config[CONF_BLE_ADV_CAPTURE_QUEUE_SIZE]))
+    if config[CONF_BLE_ADV_TRACE_SIZE] > 0:
+        cg.add(var.set_trace_size(config[CONF_BLE_ADV_TRACE_SIZE]))
     for encoding, params in BLE_ADV_ENCODERS.items():
         for variant, param_variant in params["variants"].items():
             if "class" in param_variant:
@@ -0,0 +1,218 @@
+#include "ble_adv_backend.h"
+#include "esphome/core/log.h"
+
+namespace esphome {
+namespace ble_adv_handler {
+
+static const char *TAG = "ble_adv_backend";
+
+void BleAdvLegacyBackend::advertise(size_t slot, BleAdvParam & param) {
+  this->op_ = Op::SET_DATA;
+  ESP_ERROR_CHECK_WITHOUT_ABORT(esp_ble_gap_config_adv_data_raw(param.get_full_buf(), param.get_full_len()));
+}
+
+void BleAdvLegacyBackend::stop(size_t slot) {
+  this->op_ = Op::STOP;
+  ESP_ERROR_CHECK_WITHOUT_ABORT(esp_ble_gap_stop_advertising());
+}
+
+void BleAdvLegacyBackend::reset(size_t slot) {
+  this->op_ = Op::NONE;
+  this->running_ = false;
+  ESP_ERROR_CHECK_WITHOUT_ABORT(esp_ble_gap_stop_advertising());
+}
+
+void BleAdvLegacyBackend::gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) {
+  switch (event) {
+    case ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT:
+      if (this->op_ != Op::SET_DATA) break;
+      if (param->adv_data_raw_cmpl.status != ESP_BT_STATUS_SUCCESS) {
+        ESP_LOGW(TAG, "Setting advertising data failed: %d", param->adv_data_raw_cmpl.status);
+        this->op_ = Op::NONE;
+        this->listener_->on_slot_started(0, false);
+        break;
+      }
+      if (this->running_) {
+        // data replaced while advertising
+        this->op_ = Op::NONE;
+        this->listener_->on_slot_started(0, true);
+        break;
+      }
+      this->op_ = Op::START;
+      ESP_ERROR_CHECK_WITHOUT_ABORT(esp_ble_gap_start_advertising(&(this->adv_params_)));
+      break;
+    case ESP_GAP_BLE_ADV_START_COMPLETE_EVT:
+      if (this->op_ != Op::START) break;
+      this->op_ = Op::NONE;
+      this->running_ = (param->adv_start_cmpl.status == ESP_BT_STATUS_SUCCESS);
+      if (!this->running_) {
+        ESP_LOGW(TAG, "Start advertising failed: %d", param->adv_start_cmpl.status);
+      }
+      this->listener_->on_slot_started(0, this->running_);
+      break;
+    case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:
+      if (this->op_ != Op::STOP) break;
+      this->op_ = Op::NONE;
+      this->running_ = false;
+      this->listener_->on_slot_stopped(0);
+      break;
+    default:
+      break;
+  }
+}
+
+#ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+void BleAdvExtBackend::set_adv_params(const esp_ble_adv_params_t & adv_params) {
+  BleAdvBackend::set_adv_params(adv_params);
+  for (auto & set : this->sets_) {
+    set.params_changed_ = true;
+  }
+}
+
+void BleAdvExtBackend::advertise(size_t slot, BleAdvParam & param) {
+  AdvSet & set = this->sets_[slot];
+  set.len_ = param.get_full_len();
+  std::copy(param.get_full_buf(), param.get_full_buf() + set.len_, set.data_);
+  // the parameters of a set can only be changed while it is not advertising
+  set.next_ = (!set.running_ && set.params_changed_) ? Op::SET_PARAMS : Op::SET_DATA;
+  this->process();
+}
+
+void BleAdvExtBackend::stop(size_t slot) {
+  this->sets_[slot].next_ = Op::STOP;
+  this->process();
+}
+
+void BleAdvExtBackend::reset(size_t slot) {
+  if (this->busy_ == slot) {
+    this->busy_ = this->sets_.size();
+  }
+  AdvSet & set = this->sets_[slot];
+  set.next_ = Op::STOP;
+  set.silent_ = true;
+  this->process();
+}
+
+// Issue the next pending request, in turn for each set, if no request is in progress
+void BleAdvExtBackend::process() {
+  size_t nb_sets = this->sets_.size();
+  for (size_t i = 1; (i <= nb_sets) && (this->busy_ == nb_sets); ++i) {
+    size_t instance = (this->last_ + i) % nb_sets;
+    Op op = this->sets_[instance].next_;
+    if (op == Op::NONE) continue;
+    this->sets_[instance].next_ = Op::NONE;
+    this->last_ = instance;
+    this->busy_ = instance;
+    this->busy_op_ = op;
+    if (!this->issue(instance, op)) {
+      this->complete(op, false);
+    }
+  }
+}
+
+bool BleAdvExtBackend::issue(size_t instance, Op op) {
+  AdvSet & set = this->sets_[instance];
+  switch (op) {
+    case Op::SET_PARAMS: {
+      esp_ble_gap_ext_adv_params_t params = {};
+      params.type = ESP_BLE_LEGACY_ADV_TYPE_NONCONN_IND;
+      params.interval_min = this->adv_params_.adv_int_min;
+      params.interval_max = this->adv_params_.adv_int_max;
+      params.channel_map = this->adv_params_.channel_map;
+      params.own_addr_type = this->adv_params_.own_addr_type;
+      params.peer_addr_type = this->adv_params_.peer_addr_type;
+      std::copy(this->adv_params_.peer_addr, this->adv_params_.peer_addr + ESP_BD_ADDR_LEN, params.peer_addr);
+      params.filter_policy = this->adv_params_.adv_filter_policy;
+      params.tx_power = EXT_ADV_TX_PWR_NO_PREFERENCE;
+      params.primary_phy = ESP_BLE_GAP_PRI_PHY_1M;
+      params.secondary_phy = ESP_BLE_GAP_PHY_1M;
+      params.sid = instance;
+      return ESP_ERROR_CHECK_WITHOUT_ABORT(esp_ble_gap_ext_adv_set_params(instance, &params)) == ESP_OK;
+    }
+    case Op::SET_DATA:
+      return ESP_ERROR_CHECK_WITHOUT_ABORT(esp_ble_gap_config_ext_adv_data_raw(instance, set.len_, set.data_)) == ESP_OK;
+    case Op::START: {
+      esp_ble_gap_ext_adv_t ext_adv = { .instance = (uint8_t)instance, .duration = 0, .max_events = 0 };
+      return ESP_ERROR_CHECK_WITHOUT_ABORT(esp_ble_gap_ext_adv_start(1, &ext_adv)) == ESP_OK;
+    }
+    case Op::STOP: {
+      uint8_t ext_instance = instance;
+      return ESP_ERROR_CHECK_WITHOUT_ABORT(esp_ble_gap_ext_adv_stop(1, &ext_instance)) == ESP_OK;
+    }
+    default:
+      return false;
+  }
+}
+
+// Completion of the request in progress, then issue the next one
+void BleAdvExtBackend::complete(Op op, bool success) {
+  size_t instance = this->busy_;
+  if ((instance == this->sets_.size()) || (op != this->busy_op_)) return;
+  this->busy_ = this->sets_.size();
+  AdvSet & set = this->sets_[instance];
+  switch (op) {
+    case Op::SET_PARAMS:
+      if (!success) {
+        ESP_LOGW(TAG, "Setting advertising parameters failed on set %zu", instance);
+        this->listener_->on_slot_started(instance, false);
+        break;
+      }
+      set.params_changed_ = false;
+      if (set.next_ == Op::NONE) {
+        set.next_ = Op::SET_DATA;
+      }
+      break;
+    case Op::SET_DATA:
+      if (!success) {
+        ESP_LOGW(TAG, "Setting advertising data failed on set %zu", instance);
+        this->listener_->on_slot_started(instance, false);
+      } else if (set.running_) {
+        // data replaced while advertising
+        this->listener_->on_slot_started(instance, true);
+      } else if (set.next_ == Op::NONE) {
+        set.next_ = Op::START;
+      }
+      break;
+    case Op::START:
+      set.running_ = success;
+      if (!success) {
+        ESP_LOGW(TAG, "Start advertising failed on set %zu", instance);
+      }
+      this->listener_->on_slot_started(instance, success);
+      break;
+    case Op::STOP:
+      set.running_ = false;
+      if (set.silent_) {
+        set.silent_ = false;
+      } else {
+        this->listener_->on_slot_stopped(instance);
+      }
+      break;
+    default:
+      break;
+  }
+  this->process();
+}
+
+void BleAdvExtBackend::gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) {
+  switch (event) {
+    case ESP_GAP_BLE_EXT_ADV_SET_PARAMS_COMPLETE_EVT:
+      this->complete(Op::SET_PARAMS, param->ext_adv_set_params.status == ESP_BT_STATUS_SUCCESS);
+      break;
+    case ESP_GAP_BLE_EXT_ADV_DATA_SET_COMPLETE_EVT:
+      this->complete(Op::SET_DATA, param->ext_adv_data_set.status == ESP_BT_STATUS_SUCCESS);
+      break;
+    case ESP_GAP_BLE_EXT_ADV_START_COMPLETE_EVT:
+      this->complete(Op::START, param->ext_adv_start.status == ESP_BT_STATUS_SUCCESS);
+      break;
+    case ESP_GAP_BLE_EXT_ADV_STOP_COMPLETE_EVT:
+      this->complete(Op::STOP, param->ext_adv_stop.status == ESP_BT_STATUS_SUCCESS);
+      break;
+    default:
+      break;
+  }
+}
+#endif
+
+} // namespace ble_adv_handler
+} // namespace esphome
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "ble_adv_handler.h"
+
+namespace esphome {
+namespace ble_adv_handler {
+
+/**
+  BleAdvLegacyBackend: Single legacy advertising instance, one slot
+ */
+class BleAdvLegacyBackend final: public BleAdvBackend
+{
+public:
+  const char * get_name() const override { return "legacy"; }
+  size_t get_nb_slots() const override { return 1; }
+
+  void advertise(size_t slot, BleAdvParam & param) override;
+  void stop(size_t slot) override;
+  void reset(size_t slot) override;
+  void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) override;
+
+protected:
+  // request in progress at the stack level
+  enum class Op: uint8_t { NONE, SET_DATA, START, STOP };
+  Op op_{Op::NONE};
+  bool running_{false};
+};
+
+#ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+/**
+  BleAdvExtBackend: BLE 5 extended advertising, one advertising set per slot
+    The sets use legacy PDUs so that they can still be received by the BLE 4 devices.
+    The stack requests are issued one at a time, as the completion events of older ESP-IDF versions do not tell the set
+ */
+class BleAdvExtBackend final: public BleAdvBackend
+{
+public:
+  BleAdvExtBackend(size_t nb_sets): sets_(nb_sets), busy_(nb_sets), last_(nb_sets - 1) {}
+
+  const char * get_name() const override { return "extended"; }
+  size_t get_nb_slots() const override { return this->sets_.size(); }
+
+  void set_adv_params(const esp_ble_adv_params_t & adv_params) override;
+  void advertise(size_t slot, BleAdvParam & param) override;
+  void stop(size_t slot) override;
+  void reset(size_t slot) override;
+  void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) override;
+
+protected:
+  enum class Op: uint8_t { NONE, SET_PARAMS, SET_DATA, START, STOP };
+  struct AdvSet {
+    Op next_{Op::NONE};
+    bool running_{false};
+    bool params_changed_{true};
+    bool silent_{false};
+    uint8_t len_{0};
+    uint8_t data_[MAX_PACKET_LEN]{0};
+  };
+  std::vector< AdvSet > sets_;
+
+  // set having a request in progress at the stack level, number of sets if none
+  size_t busy_;
+  Op busy_op_{Op::NONE};
+  // last set served, to issue the pending requests in turn
+  size_t last_;
+
+  void process();
+  bool issue(size_t instance, Op op);
+  void complete(Op op, bool success);
+};
+#endif
+
+} //namespace ble_adv_handler
+} //namespace esphome
@@ -1,4 +1,5 @@
 #include "ble_adv_handler.h"
+#include "ble_adv_backend.h"
 #include "esphome/core/log.h"
 #include "esphome/core/hal.h"
 #include "esphome/core/application.h"
@@ -12,6 +13,61 @@ namespace ble_adv_handler {
 
 static const char *TAG = "ble_adv_handler";
 
+// Maximum time to wait for a GAP completion event before considering it lost
+static constexpr uint32_t ADV_EVENT_TIMEOUT = 1000;
+// Time before advertising again on a slot after a start failure
+static constexpr uint32_t ADV_RETRY_DELAY = 100;
+
+static const char * PRIORITY_NAMES[] = { "high", "medium", "low" };
+// Share of the min tx duration targeted as airtime, the remaining being left for the stack latencies
+static constexpr uint32_t TARGET_AIRTIME_PERCENT = 90;
+// Scale of the weighted airtime, divisible by the usual weights
+static constexpr uint32_t VTIME_SCALE = 120;
+// Max time spent decoding the captured packets in a loop, in us
+static constexpr uint32_t CAPTURE_DECODE_BUDGET = 2000;
+
+static constexpr Crc16Table< 0x8408, true > CRC16_LE_TABLE;
+static constexpr Crc16Table< 0x1021, false > CRC16_BE_TABLE;
+
+uint16_t crc16_le(const uint8_t * buf, size_t len, uint16_t crc) {
+  return CRC16_LE_TABLE.compute(buf, len, crc);
+}
+
+uint16_t crc16_be(const uint8_t * buf, size_t len, uint16_t crc) {
+  return CRC16_BE_TABLE.compute(buf, len, crc);
+}
+
+// FNV-1a hash of the full payload
+uint32_t BleAdvParam::hash() const {
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < this->len_; ++i) {
+    hash = (hash ^ this->buf_[i]) * 16777619UL;
+  }
+  return hash;
+}
+
+bool BleAdvProcess::add_requester(uint16_t msg_id, uint8_t flow) {
+  if (this->has_requester(msg_id) || (this->nb_ids_ == MAX_REQUESTERS)) return false;
+  this->ids_[this->nb_ids_] = msg_id;
+  this->flows_[this->nb_ids_] = flow;
+  this->nb_ids_++;
+  return true;
+}
+
+bool BleAdvProcess::has_requester(uint16_t msg_id) const {
+  return std::find(this->ids_, this->ids_ + this->nb_ids_, msg_id) != this->ids_ + this->nb_ids_;
+}
+
+bool BleAdvProcess::remove_requester(uint16_t msg_id, uint8_t & flow) {
+  size_t index = std::find(this->ids_, this->ids_ + this->nb_ids_, msg_id) - this->ids_;
+  if (index == this->nb_ids_) return false;
+  flow = this->flows_[index];
+  std::copy(this->ids_ + index + 1, this->ids_ + this->nb_ids_, this->ids_ + index);
+  std::copy(this->flows_ + index + 1, this->flows_ + this->nb_ids_, this->flows_ + index);
+  this->nb_ids_--;
+  return true;
+}
+
 void BleAdvParam::from_raw(const uint8_t * buf, size_t len) {
   // Copy the raw data as is, limiting to the max size of the buffer
   this->len_ = std::min(MAX_PACKET_LEN, len);
@@ -19,7 +75,7 @@ void BleAdvParam::from_raw(const uint8_t * buf, size_t len) {
 
   // find the data / flag indexes in the buffer
   size_t cur_len = 0;
-  while (cur_len < this->len_ - 2) {
+  while (cur_len + 2 < this->len_) {
     size_t sub_len = this->buf_[cur_len];
     uint8_t type = this->buf_[cur_len + 1];
     if (type == ESP_BLE_AD_TYPE_FLAG) {
@@ -70,6 +126,159 @@ void BleAdvParam::set_data_len(size_t len) {
   this->len_ = len + 2 + (this->has_ad_flag() ? 3 : 0);
 }
 
+void BleAdvTrace::record(Event event, uint16_t msg_id, const uint8_t * buf, size_t len) {
+  if (this->records_.empty()) return;
+  Record & rec = this->records_[this->next_];
+  rec.time_ = millis();
+  rec.msg_id_ = msg_id;
+  rec.event_ = event;
+  rec.len_ = std::min(len, MAX_PACKET_LEN);
+  if (buf != nullptr) {
+    std::copy(buf, buf + rec.len_, rec.buf_);
+  }
+  this->next_ = (this->next_ + 1) % this->records_.size();
+  this->count_ = std::min(this->count_ + 1, this->records_.size());
+}
+
+void BleAdvTrace::dump(const char * tag) const {
+  static const char * EVENT_STR[] = { "adv start", "adv stop", "capture" };
+  ESP_LOGI(tag, "Trace: %zu record(s)", this->count_);
+  // oldest record first
+  size_t start = (this->next_ + this->records_.size() - this->count_) % std::max(this->records_.size(), (size_t)1);
+  for (size_t i = 0; i < this->count_; ++i) {
+    const Record & rec = this->records_[(start + i) % this->records_.size()];
+    ESP_LOGI(tag, "%u - %s - %d: %s", rec.time_, EVENT_STR[rec.event_], rec.msg_id_,
+              esphome::format_hex_pretty(rec.buf_, rec.len_).c_str());
+  }
+}
+
+void BleAdvCaptureQueue::set_size(size_t size) {
+  size_t rounded = 1;
+  while (rounded < size) rounded <<= 1;
+  this->records_.resize(rounded);
+  this->head_ = this->tail_ = 0;
+}
+
+bool BleAdvCaptureQueue::push(const uint8_t * buf, size_t len, bool ignore_ble_param) {
+  if (this->size() == this->records_.size()) return false;
+  Record & record = this->records_[this->head_ & (this->records_.size() - 1)];
+  record.ignore_ble_param_ = ignore_ble_param;
+  record.len_ = std::min(MAX_PACKET_LEN, len);
+  std::copy(buf, buf + record.len_, record.buf_);
+  this->head_++;
+  return true;
+}
+
+const BleAdvCaptureQueue::Record * BleAdvCaptureQueue::front() const {
+  if (this->head_ == this->tail_) return nullptr;
+  return &this->records_[this->tail_ & (this->records_.size() - 1)];
+}
+
+void BleAdvDedupTable::advance(uint32_t now) {
+  uint32_t nb_ticks = (now - this->tick_start_) / TICK_DURATION;
+  this->tick_ += nb_ticks;
+  this->tick_start_ += nb_ticks * TICK_DURATION;
+}
+
+bool BleAdvDedupTable::find_or_add(uint32_t fingerprint, uint16_t rem_time, uint32_t now) {
+  if (this->entries_.empty()) return false;
+  this->advance(now);
+  this->nb_lookups_++;
+  auto set = this->entries_.begin() + (fingerprint % (this->entries_.size() / WAYS)) * WAYS;
+  Entry * found = nullptr;
+  for (auto it = set; it != set + WAYS; ++it) {
+    if (!this->is_live(*it)) {
+      found = (found == nullptr) ? &*it : found;
+      continue;
+    }
+    if (it->fingerprint_ == fingerprint) {
+      this->nb_hits_++;
+      return true;
+    }
+  }
+  if (found == nullptr) {
+    // set full: evict the entry expiring first
+    found = &*std::min_element(set, set + WAYS, [&](const Entry & a, const Entry & b) {
+      return (int32_t)(a.expiry_ - b.expiry_) < 0;
+    });
+    this->nb_evicted_++;
+  }
+  found->fingerprint_ = fingerprint;
+  // expired after rem_time seconds, plus the partial tick in progress
+  found->expiry_ = this->tick_ + ((uint32_t)rem_time * 1000 + TICK_DURATION - 1) / TICK_DURATION + 1;
+  return false;
+}
+
+void BleAdvDedupTable::remove(uint32_t fingerprint) {
+  if (this->entries_.empty()) return;
+  auto set = this->entries_.begin() + (fingerprint % (this->entries_.size() / WAYS)) * WAYS;
+  for (auto it = set; it != set + WAYS; ++it) {
+    if (this->is_live(*it) && (it->fingerprint_ == fingerprint)) {
+      it->expiry_ = this->tick_;
+    }
+  }
+}
+
+size_t BleAdvDedupTable::get_occupancy(uint32_t now) {
+  this->advance(now);
+  return std::count_if(this->entries_.begin(), this->entries_.end(), [&](const Entry & e){ return this->is_live(e); });
+}
+
+void BleAdvTimerWheel::schedule(BleAdvTimer * timer, uint32_t deadline) {
+  this->cancel(timer);
+  if (this->nb_timers_ == 0) {
+    this->tick_time_ = millis();
+  }
+  int32_t delay = deadline - this->tick_time_;
+  size_t nb_ticks = (delay > 0) ? (delay + TICK - 1) / TICK : 0;
+  size_t bucket = (this->bucket_ + nb_ticks) % NB_BUCKETS;
+  timer->deadline_ = deadline;
+  timer->armed_ = true;
+  timer->bucket_ = bucket;
+  timer->prev_ = nullptr;
+  timer->next_ = this->buckets_[bucket];
+  if (timer->next_ != nullptr) {
+    timer->next_->prev_ = timer;
+  }
+  this->buckets_[bucket] = timer;
+  this->nb_timers_++;
+}
+
+void BleAdvTimerWheel::cancel(BleAdvTimer * timer) {
+  if (!timer->armed_) return;
+  if (timer->prev_ != nullptr) {
+    timer->prev_->next_ = timer->next_;
+  } else {
+    this->buckets_[timer->bucket_] = timer->next_;
+  }
+  if (timer->next_ != nullptr) {
+    timer->next_->prev_ = timer->prev_;
+  }
+  timer->armed_ = false;
+  this->nb_timers_--;
+}
+
+void BleAdvTimerWheel::process(uint32_t now) {
+  while ((this->nb_timers_ > 0) && ((int32_t)(now - this->tick_time_) >= 0)) {
+    // move to the next tick first: the timers rescheduled by their owner when notified go to the next buckets
+    size_t bucket = this->bucket_;
+    this->bucket_ = (this->bucket_ + 1) % NB_BUCKETS;
+    this->tick_time_ += TICK;
+    BleAdvTimer * timer = this->buckets_[bucket];
+    while (timer != nullptr) {
+      if ((int32_t)(now - timer->deadline_) < 0) {
+        // deadline in a next round
+        timer = timer->next_;
+        continue;
+      }
+      this->cancel(timer);
+      timer->on_timer(now);
+      // the bucket may have been changed when notified
+      timer = this->buckets_[bucket];
+    }
+  }
+}
+
 std::string BleAdvGenCmd::str() {
   char ret[100]{0};
   size_t ind = 0;
@@ -123,41 +332,78 @@ std::string BleAdvGenCmd::str() {
   return ret;
 }
 
-void BleAdvEncoder::translate_g2e(std::vector< BleAdvEncCmd > & enc_cmds, const BleAdvGenCmd & gen_cmd) const {
-  BleAdvEncCmd enc_cmd;
+bool BleAdvEncoder::translate_g2e(BleAdvEncCmd & enc_cmd, const BleAdvGenCmd & gen_cmd) const {
   this->translator_->g2e_cmd(gen_cmd, enc_cmd);
-  if (enc_cmd.cmd != 0) {
-    enc_cmds.emplace_back(std::move(enc_cmd));
-  }
+  return enc_cmd.cmd != 0;
 }
 
 void BleAdvEncoder::translate_e2g(BleAdvGenCmd & gen_cmd, const BleAdvEncCmd & enc_cmd) const {
   this->translator_->e2g_cmd(enc_cmd, gen_cmd);
 }
 
+const uint8_t * BleAdvDecodeContext::get_data(const BleAdvEncoder & encoder) {
+  size_t offset = encoder.get_header().size();
+  size_t len = encoder.get_data_len() - offset;
+  if ((encoder.get_preprocess_id() == 0) && !encoder.is_reverse_on_decode()) {
+    // no pre processing, use the packet data directly
+    return this->param_.get_const_data_buf() + offset;
+  }
+  for (size_t i = 0; i < std::min(this->nb_slots_, NB_SLOTS); ++i) {
+    Slot & slot = this->slots_[i];
+    if ((slot.preprocess_id_ == encoder.get_preprocess_id()) && (slot.offset_ == offset) && (slot.len_ == len)
+          && (slot.reverse_ == encoder.is_reverse_on_decode())) {
+      return slot.buf_;
+    }
+  }
+
+  // Not yet computed for this packet, compute it, re using the oldest slot if all are used
+  Slot & slot = this->slots_[this->nb_slots_ % NB_SLOTS];
+  this->nb_slots_++;
+  slot.preprocess_id_ = encoder.get_preprocess_id();
+  slot.offset_ = offset;
+  slot.len_ = len;
+  slot.reverse_ = encoder.is_reverse_on_decode();
+  const uint8_t * cbuf = this->param_.get_const_data_buf() + offset;
+  std::copy(cbuf, cbuf + len, slot.buf_);
+  encoder.preprocess(slot.buf_);
+  return slot.buf_;
+}
+
 bool BleAdvEncoder::decode(const BleAdvParam & param, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const {
+  BleAdvDecodeContext ctx(param);
+  return this->decode(ctx, enc_cmd, cont);
+}
+
+bool BleAdvEncoder::decode(BleAdvDecodeContext & ctx, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const {
   // Check global len and header to discard most of encoders
+  const BleAdvParam & param = ctx.get_param();
   size_t len = param.get_data_len() - this->header_.size();
   const uint8_t * cbuf = param.get_const_data_buf();
   if (len != this->len_) return false;
   if (!std::equal(this->header_.begin(), this->header_.end(), cbuf)) return false;
 
-  // copy the data to be decoded, not to alter it for other decoders
-  uint8_t buf[MAX_PACKET_LEN]{0};
-  std::copy(cbuf, cbuf + param.get_data_len(), buf);
-  return this->decode(buf + this->header_.size(), enc_cmd, cont);
+  // cheap checks on the raw data, before requesting the pre processed data
+  if (!this->precheck(cbuf + this->header_.size())) return false;
+  return this->decode(ctx.get_data(*this), ctx.get_scratch(), enc_cmd, cont);
 }
 
-void BleAdvEncoder::encode(std::vector< BleAdvParam > & params, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const {
-  params.emplace_back();
-  BleAdvParam & param = params.back();
+void BleAdvEncoder::preprocess(uint8_t * buf) const {
+  this->apply_whiten_key(buf);
+  if (this->reverse_on_decode_) {
+    this->reverse_all(buf, this->len_);
+  }
+}
+
+void BleAdvEncoder::encode(BleAdvParam & param, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const {
   param.init_with_ble_param(this->ad_flag_, this->adv_data_type_);
   std::copy(this->header_.begin(), this->header_.end(), param.get_data_buf());
   uint8_t * buf = param.get_data_buf() + this->header_.size();
   this->encode(buf, enc_cmd, cont);
 
-  ESP_LOGD(this->id_.c_str(), "UUID: '0x%X', index: %d, tx: %d, enc: %s", 
-      cont.id_, cont.index_, cont.tx_count_, this->to_str(enc_cmd).c_str());
+  if (log_enabled(ESPHOME_LOG_LEVEL_DEBUG)) {
+    ESP_LOGD(this->id_.c_str(), "UUID: '0x%X', index: %d, tx: %d, enc: %s", 
+        cont.id_, cont.index_, cont.tx_count_, this->to_str(enc_cmd).c_str());
+  }
 
   param.set_data_len(this->len_ + this->header_.size());    
 }
@@ -178,23 +424,141 @@ void BleAdvEncoder::whiten(uint8_t *buf, size_t len, uint8_t seed) const {
   }
 }
 
+void BleAdvEncoder::add_whiten_key(size_t len, uint8_t seed) {
+  // whitening a zero buffer gives the keystream, several whitenings combine by xor
+  this->whiten(this->whiten_key_, std::min(len, MAX_PACKET_LEN), seed);
+  this->preprocess_id_ = (this->preprocess_id_ * 16777619UL) ^ ((len << 8) | seed);
+}
+
+void BleAdvEncoder::reset_whiten_key() {
+  std::fill(this->whiten_key_, this->whiten_key_ + MAX_PACKET_LEN, 0);
+  this->preprocess_id_ = 0;
+}
+
+void BleAdvEncoder::apply_whiten_key(uint8_t *buf) const {
+  // xor 4 bytes at a time, memcpy as the buffers are not aligned
+  size_t i = 0;
+  for (; i + sizeof(uint32_t) <= this->len_; i += sizeof(uint32_t)) {
+    uint32_t data, key;
+    std::memcpy(&data, buf + i, sizeof(uint32_t));
+    std::memcpy(&key, this->whiten_key_ + i, sizeof(uint32_t));
+    data ^= key;
+    std::memcpy(buf + i, &data, sizeof(uint32_t));
+  }
+  for (; i < this->len_; ++i) {
+    buf[i] ^= this->whiten_key_[i];
+  }
+}
+
+uint8_t BleAdvEncoder::reverse_byte(uint8_t x) {
+  x = ((x & 0x55) << 1) | ((x & 0xAA) >> 1);
+  x = ((x & 0x33) << 2) | ((x & 0xCC) >> 2);
+  x = ((x & 0x0F) << 4) | ((x & 0xF0) >> 4);
+  return x;
+}
+
 void BleAdvEncoder::reverse_all(uint8_t* buf, uint8_t len) const {
   for (size_t i = 0; i < len; ++i) {
-    uint8_t & x = buf[i];
-    x = ((x & 0x55) << 1) | ((x & 0xAA) >> 1);
-    x = ((x & 0x33) << 2) | ((x & 0xCC) >> 2);
-    x = ((x & 0x0F) << 4) | ((x & 0xF0) >> 4);
+    buf[i] = reverse_byte(buf[i]);
   }
 }
 
 void BleAdvHandler::setup() {
+  this->packets_.resize(this->max_packets_);
+  // extended advertising on explicit request only: max_adv_sets defaults to 1, even on the BLE 5 variants
+#ifdef CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+  if (!this->backend_ && (this->max_adv_sets_ > 1)) {
+    this->backend_.reset(new BleAdvExtBackend(this->max_adv_sets_));
+  }
+#else
+  if (this->max_adv_sets_ > 1) {
+    ESP_LOGW(TAG, "Extended advertising not supported by the BLE stack, falling back to legacy advertising");
+  }
+#endif
+  if (!this->backend_) {
+    this->backend_.reset(new BleAdvLegacyBackend());
+  }
+  this->backend_->set_listener(this);
+  this->backend_->set_adv_params(this->adv_params_);
+  this->backend_->setup();
+
+  // one slot timer per advertising slot, the slots being never moved once created
+  this->slots_.resize(this->backend_->get_nb_slots());
+  for (size_t i = 0; i < this->slots_.size(); ++i) {
+    AdvSlot & slot = this->slots_[i];
+    slot.handler_ = this;
+    slot.index_ = i;
+    esp_timer_create_args_t timer_args = {
+      .callback = &BleAdvHandler::on_slot_timer,
+      .arg = &slot,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "ble_adv_slot",
+      .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_timer_create(&timer_args, &slot.timer_));
+  }
+  esp32_ble::global_ble->register_gap_event_handler(this);
 #ifdef USE_API
   register_service(&BleAdvHandler::on_raw_decode, "raw_decode", {"raw"});
+  if (this->trace_.is_enabled()) {
+    register_service(&BleAdvHandler::on_dump_trace, "dump_trace");
+  }
+#endif
+}
+
+void BleAdvHandler::dump_config() {
+  ESP_LOGCONFIG(TAG, "BleAdvHandler");
+  ESP_LOGCONFIG(TAG, "  Encoders: %zu, in %zu decoding groups", this->encoders_.size(), this->decode_index_.size());
+  ESP_LOGCONFIG(TAG, "  Trace: %s", this->trace_.is_enabled() ? "enabled" : "disabled");
+#ifdef USE_ESP32_BLE_CLIENT
+  ESP_LOGCONFIG(TAG, "  Capture: %d processed, %d dropped, queue depth %zu / %zu, %zu max used", this->nb_capture_processed_,
+                this->nb_capture_dropped_, this->capture_queue_.size(), this->capture_queue_.get_size(), this->capture_queue_high_water_);
+  BleAdvDedupTable & dedup = this->capture_dedup_;
+  ESP_LOGCONFIG(TAG, "  Capture dedup: %zu / %zu entries used, %d%% hit rate over %d packets, %d evicted",
+                dedup.get_occupancy(millis()), dedup.get_size(),
+                (dedup.nb_lookups_ > 0) ? (100 * dedup.nb_hits_ / dedup.nb_lookups_) : 0, dedup.nb_lookups_, dedup.nb_evicted_);
 #endif
+  ESP_LOGCONFIG(TAG, "  Advertiser: %zu packets max, %zu max used, %d evicted, %d dropped, %d shared", this->packets_.size(), 
+                this->packets_high_water_, this->nb_packets_evicted_, this->nb_packets_dropped_, this->nb_packets_shared_);
+  ESP_LOGCONFIG(TAG, "  Advertiser backend: %s, %zu slots", this->backend_->get_name(), this->slots_.size());
+  for (size_t i = 0; i < NB_PRIORITIES; ++i) {
+    ESP_LOGCONFIG(TAG, "  Scheduler, %s priority: target airtime reached by %d packets, missed by %d", PRIORITY_NAMES[i],
+                  this->nb_target_met_[i], this->nb_target_missed_[i]);
+  }
+  uint32_t now = millis();
+  uint32_t total_airtime = 0;
+  for (auto & flow : this->flows_) {
+    total_airtime += flow.get_window_airtime(now);
+  }
+  for (auto & flow : this->flows_) {
+    uint32_t airtime = flow.get_window_airtime(now);
+    ESP_LOGCONFIG(TAG, "  Airtime share of '%s', weight %d: %d%% (%d ms over the last %zu s)",
+                  (flow.owner_ != nullptr) ? flow.owner_->get_name().c_str() : "unknown",
+                  flow.weight_, (total_airtime > 0) ? (100 * airtime / total_airtime) : 0, airtime,
+                  WINDOW_BUCKETS * WINDOW_BUCKET_DURATION / 1000);
+  }
 }
 
 void BleAdvHandler::add_encoder(BleAdvEncoder * encoder) { 
   this->encoders_.push_back(encoder);
+
+  // Reference the encoder in the decoding index
+  const BleAdvHeader & header = encoder->get_header();
+  for (auto & group : this->decode_index_) {
+    if ((group.data_len_ == encoder->get_data_len()) && (group.header_ == header)) {
+      group.encoders_.push_back(encoder);
+      return;
+    }
+  }
+  this->decode_index_.emplace_back();
+  DecodeGroup & group = this->decode_index_.back();
+  group.data_len_ = encoder->get_data_len();
+  group.header_ = header;
+  group.encoders_.push_back(encoder);
+}
+
+bool BleAdvHandler::DecodeGroup::match(const BleAdvParam & param) const {
+  return (this->data_len_ == param.get_data_len()) && std::equal(this->header_.begin(), this->header_.end(), param.get_const_data_buf());
 }
 
 BleAdvEncoder * BleAdvHandler::get_encoder(const std::string & id) {
@@ -218,72 +582,342 @@ std::vector<std::string> BleAdvHandler::get_ids(const std::string & encoding) {
   return ids;
 }
 
-uint16_t BleAdvHandler::add_to_advertiser(std::vector< BleAdvParam > & params) {
+uint16_t BleAdvHandler::add_to_advertiser(BleAdvParams & params, const BleAdvSchedParam & sched) {
+  LockGuard lock(this->adv_mutex_);
   uint32_t msg_id = ++this->id_count;
+  bool log_packets = log_enabled(ESPHOME_LOG_LEVEL_DEBUG);
+  uint32_t now = millis();
+  uint8_t priority = get_priority(sched.cmd_type_);
+  uint32_t target_airtime = params.empty() ? 0 : sched.min_tx_duration_ * TARGET_AIRTIME_PERCENT / 100 / params.size();
+  // time given to reach the target airtime: the min tx duration for high priority, twice for medium, the max tx duration for low
+  uint32_t budget = sched.min_tx_duration_ * (priority + 1);
+  if (priority == PRIORITY_LOW) {
+    budget = std::max(sched.min_tx_duration_, sched.max_tx_duration_);
+  }
+  uint32_t deadline = now + budget;
+  uint8_t flow = this->get_flow(sched);
+  BleAdvProcess * first = nullptr;
   for (auto & param : params) {
-    this->packets_.emplace_back(BleAdvProcess(msg_id, std::move(param)));
-    ESP_LOGD(TAG, "request start advertising - %d: %s", msg_id, 
-                esphome::format_hex_pretty(param.get_full_buf(), param.get_full_len()).c_str());
+    uint32_t hash = param.hash();
+    BleAdvProcess * packet = this->find_packet(param, hash);
+    if (packet != nullptr) {
+      // identical packet already in the advertiser: kept until all its requesters removed it, and scheduled
+      // as the most urgent of them
+      this->nb_packets_shared_++;
+      if (packet->add_requester(msg_id, flow)) {
+        this->flows_[flow].nb_packets_++;
+      }
+      this->trace_.record(BleAdvTrace::ADV_START, msg_id, packet->param_.get_full_buf(), packet->param_.get_full_len());
+      if (log_packets) {
+        ESP_LOGD(TAG, "request start advertising - %d: shared with %d", msg_id, packet->get_id());
+      }
+      packet->to_be_removed_ = false;
+      packet->priority_ = std::min(packet->priority_, priority);
+      if ((int32_t)(deadline - packet->deadline_) < 0) {
+        packet->deadline_ = deadline;
+      }
+      packet->target_airtime_ = std::max(packet->target_airtime_, packet->airtime_ + target_airtime);
+      first = (first == nullptr) ? packet : first;
+      continue;
+    }
+    packet = this->allocate_packet();
+    if (packet == nullptr) {
+      this->nb_packets_dropped_++;
+      ESP_LOGW(TAG, "Advertiser full (%zu packets), packet dropped - %d", this->packets_.size(), msg_id);
+      continue;
+    }
+    packet->nb_ids_ = 0;
+    packet->add_requester(msg_id, flow);
+    packet->hash_ = hash;
+    packet->param_ = std::move(param);
+    packet->priority_ = priority;
+    packet->added_time_ = now;
+    packet->deadline_ = deadline;
+    packet->target_airtime_ = target_airtime;
+    packet->airtime_ = 0;
+    packet->first_air_time_ = 0;
+    packet->served_seq_ = 0;
+    packet->flow_ = flow;
+    this->flows_[flow].nb_packets_++;
+    first = (first == nullptr) ? packet : first;
+    this->trace_.record(BleAdvTrace::ADV_START, msg_id, packet->param_.get_full_buf(), packet->param_.get_full_len());
+    if (log_packets) {
+      ESP_LOGD(TAG, "request start advertising - %d: %s", msg_id, 
+                  esphome::format_hex_pretty(packet->param_.get_full_buf(), packet->param_.get_full_len()).c_str());
+    }
   }
   params.clear(); // As we moved the content, just to be sure no caller will re use it
+  if (first != nullptr) {
+    this->preempt_for(*first);
+    this->on_packets_changed();
+  }
   return this->id_count;
 }
 
 void BleAdvHandler::remove_from_advertiser(uint16_t msg_id) {
-  ESP_LOGD(TAG, "request stop advertising - %d", msg_id);
-  for (auto & param : this->packets_) {
-    if (param.id_ == msg_id) {
-      param.to_be_removed_ = true;
+  LockGuard lock(this->adv_mutex_);
+  if (log_enabled(ESPHOME_LOG_LEVEL_DEBUG)) {
+    ESP_LOGD(TAG, "request stop advertising - %d", msg_id);
+  }
+  this->trace_.record(BleAdvTrace::ADV_STOP, msg_id);
+  uint8_t flow = 0;
+  for (auto & packet : this->packets_) {
+    if (!packet.in_use_ || !packet.remove_requester(msg_id, flow)) continue;
+    this->flows_[flow].nb_packets_--;
+    if (packet.nb_ids_ == 0) {
+      packet.to_be_removed_ = true;
+    }
+  }
+  this->on_packets_changed();
+}
+
+uint32_t BleAdvHandler::get_min_airtime_left(uint16_t msg_id) {
+  LockGuard lock(this->adv_mutex_);
+  for (auto & slot : this->slots_) {
+    if (slot.state_ == AdvState::ADVERTISING) {
+      this->update_airtime(slot);
+    }
+  }
+  // the packets dropped or evicted do not prevent it
+  uint32_t left = 0;
+  for (auto & packet : this->packets_) {
+    if (packet.in_use_ && packet.has_requester(msg_id) && (packet.airtime_ < packet.param_.duration_)) {
+      left = std::max(left, packet.param_.duration_ - packet.airtime_);
+    }
+  }
+  return left;
+}
+
+BleAdvProcess * BleAdvHandler::allocate_packet() {
+  BleAdvProcess * found = nullptr;
+  if (this->nb_packets_ < this->packets_.size()) {
+    found = &*std::find_if(this->packets_.begin(), this->packets_.end(), [](BleAdvProcess & p){ return !p.in_use_; });
+  } else {
+    // Full: evict the oldest packet already advertised once, except the ones being advertised
+    for (auto & packet : this->packets_) {
+      if (packet.processed_once_ && !packet.advertising_ && ((found == nullptr) || (packet.seq_ < found->seq_))) {
+        found = &packet;
+      }
+    }
+    if (found == nullptr) return nullptr;
+    this->nb_packets_evicted_++;
+    ESP_LOGW(TAG, "Advertiser full (%zu packets), oldest packet evicted - %d", this->packets_.size(), found->get_id());
+    this->release_packet(*found);
+  }
+  found->in_use_ = true;
+  found->seq_ = ++this->packets_seq_;
+  this->nb_packets_++;
+  this->packets_high_water_ = std::max(this->packets_high_water_, this->nb_packets_);
+  return found;
+}
+
+void BleAdvHandler::release_packet(BleAdvProcess & packet) {
+  // requesters still there when evicted
+  for (size_t i = 0; i < packet.nb_ids_; ++i) {
+    this->flows_[packet.flows_[i]].nb_packets_--;
+  }
+  packet.nb_ids_ = 0;
+  bool target_met = (packet.airtime_ >= packet.target_airtime_);
+  (target_met ? this->nb_target_met_ : this->nb_target_missed_)[packet.priority_]++;
+  if (log_enabled(ESPHOME_LOG_LEVEL_DEBUG)) {
+    ESP_LOGD(TAG, "packet released - %d: %s priority, airtime %d / %d ms, first on air after %d ms", packet.get_id(),
+              PRIORITY_NAMES[packet.priority_], packet.airtime_, packet.target_airtime_,
+              (packet.first_air_time_ != 0) ? (int)(packet.first_air_time_ - packet.added_time_) : -1);
+  }
+  packet.in_use_ = false;
+  packet.processed_once_ = false;
+  packet.to_be_removed_ = false;
+  packet.advertising_ = false;
+  this->nb_packets_--;
+}
+
+// Packet identical to the given one, advertised for the same duration, and able to accept one more requester
+BleAdvProcess * BleAdvHandler::find_packet(const BleAdvParam & param, uint32_t hash) {
+  for (auto & packet : this->packets_) {
+    if (packet.in_use_ && (packet.hash_ == hash) && (packet.nb_ids_ < BleAdvProcess::MAX_REQUESTERS)
+        && (packet.param_ == param) && (packet.param_.duration_ == param.duration_)) {
+      return &packet;
     }
   }
+  return nullptr;
+}
+
+// Priority of a command: pairing and global commands first, then state changes, then continuous changes
+uint8_t BleAdvHandler::get_priority(CommandType cmd_type) {
+  switch (cmd_type) {
+    case CommandType::PAIR:
+    case CommandType::UNPAIR:
+    case CommandType::ALL_OFF:
+      return PRIORITY_HIGH;
+    case CommandType::LIGHT_ON:
+    case CommandType::LIGHT_OFF:
+    case CommandType::LIGHT_SEC_ON:
+    case CommandType::LIGHT_SEC_OFF:
+    case CommandType::FAN_ONOFF_SPEED:
+    case CommandType::FAN_DIR:
+    case CommandType::FAN_OSC:
+      return PRIORITY_MEDIUM;
+    default:
+      return PRIORITY_LOW;
+  }
+}
+
+// A packet is in its deadline phase until it reaches its target airtime or its deadline
+bool BleAdvHandler::in_deadline_phase(const BleAdvProcess & packet, uint32_t now) {
+  return (packet.airtime_ < packet.target_airtime_) && ((int32_t)(now - packet.deadline_) < 0);
+}
+
+// Scheduling order: the packets in deadline phase first, by earliest deadline then priority,
+// then the ones of the controller having the lowest weighted airtime, then the least recently served, then the oldest
+bool BleAdvHandler::is_before(const BleAdvProcess & first, const BleAdvProcess & second, uint32_t now) const {
+  bool first_edf = in_deadline_phase(first, now);
+  bool second_edf = in_deadline_phase(second, now);
+  if (first_edf != second_edf) return first_edf;
+  if (first_edf) {
+    int32_t diff = (int32_t)(first.deadline_ - second.deadline_);
+    if (diff != 0) return diff < 0;
+    if (first.priority_ != second.priority_) return first.priority_ < second.priority_;
+  } else if (first.flow_ != second.flow_) {
+    int32_t diff = (int32_t)(this->flows_[first.flow_].vtime_ - this->flows_[second.flow_].vtime_);
+    if (diff != 0) return diff < 0;
+  }
+  if (first.served_seq_ != second.served_seq_) return first.served_seq_ < second.served_seq_;
+  return (int32_t)(first.seq_ - second.seq_) < 0;
+}
+
+// Airtime sharing flow of the controller, created on its first message
+uint8_t BleAdvHandler::get_flow(const BleAdvSchedParam & sched) {
+  auto it = std::find_if(this->flows_.begin(), this->flows_.end(), [&](AdvFlow & f){ return f.owner_ == sched.owner_; });
+  if (it == this->flows_.end()) {
+    this->flows_.emplace_back();
+    it = this->flows_.end() - 1;
+    it->owner_ = sched.owner_;
+    it->bucket_start_ = millis();
+  }
+  it->weight_ = std::max< uint8_t >(sched.weight_, 1);
+  if (it->nb_packets_ == 0) {
+    // becoming active: no credit for the time spent idle, start from the lowest weighted airtime of the active ones
+    const AdvFlow * lowest = nullptr;
+    for (auto & flow : this->flows_) {
+      if ((flow.nb_packets_ > 0) && ((lowest == nullptr) || ((int32_t)(flow.vtime_ - lowest->vtime_) < 0))) {
+        lowest = &flow;
+      }
+    }
+    if ((lowest != nullptr) && ((int32_t)(lowest->vtime_ - it->vtime_) > 0)) {
+      it->vtime_ = lowest->vtime_;
+    }
+  }
+  return it - this->flows_.begin();
+}
+
+void BleAdvHandler::AdvFlow::advance(uint32_t now) {
+  uint32_t nb_buckets = (now - this->bucket_start_) / WINDOW_BUCKET_DURATION;
+  this->bucket_start_ += nb_buckets * WINDOW_BUCKET_DURATION;
+  for (uint32_t i = 0; i < std::min< uint32_t >(nb_buckets, WINDOW_BUCKETS); ++i) {
+    this->bucket_ = (this->bucket_ + 1) % WINDOW_BUCKETS;
+    this->window_[this->bucket_] = 0;
+  }
+}
+
+void BleAdvHandler::AdvFlow::add_airtime(uint32_t airtime, uint32_t now) {
+  this->vtime_ += airtime * VTIME_SCALE / this->weight_;
+  this->advance(now);
+  this->window_[this->bucket_] += airtime;
+}
+
+uint32_t BleAdvHandler::AdvFlow::get_window_airtime(uint32_t now) {
+  this->advance(now);
+  uint32_t airtime = 0;
+  for (auto bucket_airtime : this->window_) {
+    airtime += bucket_airtime;
+  }
+  return airtime;
+}
+
+// index of the first packet to be scheduled among the ones waiting for a slot, size of the slab if none
+size_t BleAdvHandler::select_packet(uint32_t now) const {
+  size_t size = this->packets_.size();
+  size_t selected = size;
+  for (size_t i = 0; i < size; ++i) {
+    const BleAdvProcess & packet = this->packets_[i];
+    if (!packet.in_use_ || packet.advertising_) continue;
+    if ((selected == size) || this->is_before(packet, this->packets_[selected], now)) {
+      selected = i;
+    }
+  }
+  return selected;
 }
 
 // try to identify the relevant encoder
 bool BleAdvHandler::identify_param(const BleAdvParam & param, bool ignore_ble_param) {
-  for(auto & encoder : this->encoders_) {
-    if (!ignore_ble_param && !encoder->is_ble_param(param.get_ad_flag(), param.get_data_type())) {
+  if (!param.has_data()) return false;
+  this->nb_decode_packets_++;
+  size_t nb_candidates = 0;
+  BleAdvDecodeContext ctx(param);
+  for (auto & group : this->decode_index_) {
+    if (!group.match(param)) {
       continue;
     }
-    ControllerParam_t cont;
-    BleAdvEncCmd enc_cmd;
-    if(encoder->decode(param, enc_cmd, cont)) {
-      BleAdvGenCmd gen_cmd;
-      encoder->translate_e2g(gen_cmd, enc_cmd);
-      ESP_LOGI(encoder->get_id().c_str(), "Decoded OK - tx: %d, gen: %s, enc: %s", 
-                cont.tx_count_, gen_cmd.str().c_str(), encoder->to_str(enc_cmd).c_str());
-
-      if (gen_cmd.cmd == CommandType::PAIR) {
-        std::string config_str = "config: \nble_adv_controller:";
-        config_str += "\n  - id: my_controller_id";
-        config_str += "\n    encoding: %s";
-        config_str += "\n    variant: %s";
-        config_str += "\n    forced_id: 0x%X";
-        if (cont.index_ != 0) {
-          config_str += "\n    index: %d";
-        }
-        ESP_LOGI(TAG, config_str.c_str(), encoder->get_encoding().c_str(), encoder->get_variant().c_str(), cont.id_, cont.index_);
-      }
-      
-      // Re encoding with the same parameters to check if it gives the same output
-      std::vector< BleAdvParam > params;
-      std::vector< BleAdvEncCmd > re_enc_cmds;
-      encoder->translate_g2e(re_enc_cmds, gen_cmd);
-      for (auto & re_enc_cmd: re_enc_cmds) {
-        encoder->encode(params, re_enc_cmd, cont);
-        BleAdvParam & fparam = params.back();
-        ESP_LOGD(TAG, "enc - %s", esphome::format_hex_pretty(fparam.get_full_buf(), fparam.get_full_len()).c_str());
-        bool nodiff = std::equal(param.get_const_data_buf(), param.get_const_data_buf() + param.get_data_len(), fparam.get_data_buf());
-        nodiff ? ESP_LOGI(TAG, "Decoded / Re-encoded with NO DIFF") : ESP_LOGE(TAG, "DIFF after Decode / Re-encode");
+    for(auto & encoder : group.encoders_) {
+      if (!ignore_ble_param && !encoder->is_ble_param(param.get_ad_flag(), param.get_data_type())) {
+        continue;
       }
-      if (re_enc_cmds.empty()){
-        ESP_LOGD(TAG, "No corresponding command to encode.");
+      this->nb_decode_candidates_++;
+      nb_candidates++;
+      if (this->identify_param(ctx, encoder)) {
+        ESP_LOGV(TAG, "%zu candidate(s) tried - totals: %d packets, %d candidates", nb_candidates, this->nb_decode_packets_, this->nb_decode_candidates_);
+        return true;
       }
-      return true;
-    } 
+    }
   }
+  ESP_LOGV(TAG, "%zu candidate(s) tried, not decoded - totals: %d packets, %d candidates", nb_candidates, this->nb_decode_packets_, this->nb_decode_candidates_);
   return false;
 }
 
+// decode the param with the given encoder and log Action and Controller parameters
+bool BleAdvHandler::identify_param(BleAdvDecodeContext & ctx, BleAdvEncoder * encoder) {
+  const BleAdvParam & param = ctx.get_param();
+  ControllerParam_t cont;
+  BleAdvEncCmd enc_cmd;
+  if(!encoder->decode(ctx, enc_cmd, cont)) {
+    return false;
+  }
+
+  BleAdvGenCmd gen_cmd;
+  encoder->translate_e2g(gen_cmd, enc_cmd);
+  if (log_enabled(ESPHOME_LOG_LEVEL_INFO)) {
+    ESP_LOGI(encoder->get_id().c_str(), "Decoded OK - tx: %d, gen: %s, enc: %s", 
+              cont.tx_count_, gen_cmd.str().c_str(), encoder->to_str(enc_cmd).c_str());
+  }
+
+  if (gen_cmd.cmd == CommandType::PAIR) {
+    std::string config_str = "config: \nble_adv_controller:";
+    config_str += "\n  - id: my_controller_id";
+    config_str += "\n    encoding: %s";
+    config_str += "\n    variant: %s";
+    config_str += "\n    forced_id: 0x%X";
+    if (cont.index_ != 0) {
+      config_str += "\n    index: %d";
+    }
+    ESP_LOGI(TAG, config_str.c_str(), encoder->get_encoding().c_str(), encoder->get_variant().c_str(), cont.id_, cont.index_);
+  }
+  
+  // Re encoding with the same parameters to check if it gives the same output
+  BleAdvEncCmd re_enc_cmd;
+  if (!encoder->translate_g2e(re_enc_cmd, gen_cmd)) {
+    ESP_LOGD(TAG, "No corresponding command to encode.");
+    return true;
+  }
+  BleAdvParam fparam;
+  encoder->encode(fparam, re_enc_cmd, cont);
+  if (log_enabled(ESPHOME_LOG_LEVEL_DEBUG)) {
+    ESP_LOGD(TAG, "enc - %s", esphome::format_hex_pretty(fparam.get_full_buf(), fparam.get_full_len()).c_str());
+  }
+  bool nodiff = std::equal(param.get_const_data_buf(), param.get_const_data_buf() + param.get_data_len(), fparam.get_data_buf());
+  nodiff ? ESP_LOGI(TAG, "Decoded / Re-encoded with NO DIFF") : ESP_LOGE(TAG, "DIFF after Decode / Re-encode");
+  return true;
+}
+
 #ifdef USE_API
 void BleAdvHandler::on_raw_decode(std::string raw) {
   BleAdvParam param;
@@ -291,6 +925,10 @@ void BleAdvHandler::on_raw_decode(std::string raw) {
   ESP_LOGD(TAG, "raw - %s", esphome::format_hex_pretty(param.get_full_buf(), param.get_full_len()).c_str());
   this->identify_param(param, true);
 }
+
+void BleAdvHandler::on_dump_trace() {
+  this->trace_.dump(TAG);
+}
 #endif
 
 #ifdef USE_ESP32_BLE_CLIENT
@@ -299,61 +937,282 @@ void BleAdvHandler::on_raw_decode(std::string raw) {
 */
 class HackESPBTDevice: public esp32_ble_tracker::ESPBTDevice {
 public:
-  void get_raw_packet(BleAdvParam & param) const {
-    param.from_raw(this->scan_result_.ble_adv, this->scan_result_.adv_data_len);
+  void get_raw_packet(const uint8_t *& buf, size_t & len) const {
+    buf = this->scan_result_.ble_adv;
+    len = this->scan_result_.adv_data_len;
   }
 };
 
 void BleAdvHandler::capture(const esp32_ble_tracker::ESPBTDevice & device, bool ignore_ble_param, uint16_t rem_time) {
-  // Clean-up expired packets
-  this->listen_packets_.remove_if( [&](BleAdvParam & p){ return p.duration_ < millis(); } );
-
-  // Read raw advertised packets
-  BleAdvParam param;
+  const uint8_t * buf = nullptr;
+  size_t len = 0;
   const HackESPBTDevice * hack_device = reinterpret_cast< const HackESPBTDevice * >(&device);
-  hack_device->get_raw_packet(param);
+  hack_device->get_raw_packet(buf, len);
+  if (len == 0) return;
+  // Check if not already received in the last rem_time seconds, the repeated packets being the most frequent ones
+  BleAdvParam param;
+  param.from_raw(buf, len);
   if (!param.has_data()) return;
+  if (this->capture_dedup_.find_or_add(param.hash(), rem_time, millis())) return;
+  if (!this->capture_queue_.push(buf, len, ignore_ble_param)) {
+    // not decoded: its retransmissions have to be
+    this->capture_dedup_.remove(param.hash());
+    this->nb_capture_dropped_++;
+    return;
+  }
+  this->capture_queue_high_water_ = std::max(this->capture_queue_high_water_, this->capture_queue_.size());
+}
 
-  // Check if not already received in the last 300s
-  auto idx = std::find(this->listen_packets_.begin(), this->listen_packets_.end(), param);
-  if (idx == this->listen_packets_.end()) {
+// Decode the captured packets within a time budget, the remaining ones being decoded at the next loop
+void BleAdvHandler::process_captures() {
+  uint32_t start = micros();
+  const BleAdvCaptureQueue::Record * record = nullptr;
+  while ((record = this->capture_queue_.front()) != nullptr) {
+    this->decode_capture(*record);
+    this->capture_queue_.pop();
+    this->nb_capture_processed_++;
+    if (micros() - start > CAPTURE_DECODE_BUDGET) break;
+  }
+}
+
+void BleAdvHandler::decode_capture(const BleAdvCaptureQueue::Record & record) {
+  BleAdvParam param;
+  param.from_raw(record.buf_, record.len_);
+  this->trace_.record(BleAdvTrace::CAPTURE, 0, param.get_full_buf(), param.get_full_len());
+  if (log_enabled(ESPHOME_LOG_LEVEL_DEBUG)) {
     ESP_LOGD(TAG, "raw - %s", esphome::format_hex_pretty(param.get_full_buf(), param.get_full_len()).c_str());
-    param.duration_ = millis() + (uint32_t)rem_time * 1000;
-    this->identify_param(param, ignore_ble_param);
-    this->listen_packets_.emplace_back(std::move(param));
   }
+  this->identify_param(param, record.ignore_ble_param_);
 }
 #endif
 
 void BleAdvHandler::loop() {
-  if (this->adv_stop_time_ == 0) {
-    // No packet is being advertised, process with clean-up IF already processed once and requested for removal
-    this->packets_.remove_if([&](BleAdvProcess & p){ return p.processed_once_ && p.to_be_removed_; } );
-    // if packets to be advertised, advertise the front one
-    if (!this->packets_.empty()) {
-      BleAdvParam & packet = this->packets_.front().param_;
-      ESP_ERROR_CHECK_WITHOUT_ABORT(esp_ble_gap_config_adv_data_raw(packet.get_full_buf(), packet.get_full_len()));
-      ESP_ERROR_CHECK_WITHOUT_ABORT(esp_ble_gap_start_advertising(&(this->adv_params_)));
-      this->adv_stop_time_ = millis() + this->packets_.front().param_.duration_;
-      this->packets_.front().processed_once_ = true;
+  this->timers_.process(millis());
+#ifdef USE_ESP32_BLE_CLIENT
+  this->process_captures();
+#endif
+}
+
+void BleAdvHandler::set_slot_state(AdvSlot & slot, AdvState state) {
+  slot.state_ = state;
+  slot.state_time_ = millis();
+}
+
+void BleAdvHandler::set_adv_params(const esp_ble_adv_params_t & adv_params) {
+  LockGuard lock(this->adv_mutex_);
+  this->adv_params_ = adv_params;
+  if (!this->backend_) return;
+  this->backend_->set_adv_params(adv_params);
+  // to be taken into account at next start
+  for (auto & slot : this->slots_) {
+    slot.adv_params_changed_ = true;
+  }
+}
+
+// Release the packets already processed once and requested for removal, except the ones being advertised
+void BleAdvHandler::clean_packets() {
+  for (auto & packet : this->packets_) {
+    if (packet.in_use_ && packet.processed_once_ && packet.to_be_removed_ && !packet.advertising_) {
+      this->release_packet(packet);
     }
-  } else {
-    // Packet is being advertised, check if time to switch to next one in case:
-    // The advertise seq_duration expired AND
-    // There is more than one packet to advertise OR the front packet was requested to be removed
-    bool multi_packets = (this->packets_.size() > 1);
-    bool front_to_be_removed = this->packets_.front().to_be_removed_;
-    if ((millis() > this->adv_stop_time_) && (multi_packets || front_to_be_removed)) {
-      ESP_ERROR_CHECK_WITHOUT_ABORT(esp_ble_gap_stop_advertising());
-      this->adv_stop_time_ = 0;
-      if (front_to_be_removed) {
-        this->packets_.pop_front();
-      } else if (multi_packets) {
-        this->packets_.emplace_back(std::move(this->packets_.front()));
-        this->packets_.pop_front();
-      }
+  }
+}
+
+void BleAdvHandler::start_packet(AdvSlot & slot, size_t index) {
+  BleAdvProcess & process = this->packets_[index];
+  process.processed_once_ = true;
+  process.advertising_ = true;
+  process.served_seq_ = ++this->served_seq_;
+  slot.packet_ = index;
+  slot.expired_ = false;
+  this->backend_->advertise(slot.index_, process.param_);
+}
+
+// Account the airtime of the packet on air on the slot up to now
+void BleAdvHandler::update_airtime(AdvSlot & slot) {
+  uint32_t now = millis();
+  BleAdvProcess & process = this->packets_[slot.packet_];
+  uint32_t airtime = now - slot.on_air_time_;
+  process.airtime_ += airtime;
+  // charged once to the flow of each requester, or to the first one if all removed it while on air
+  if (process.nb_ids_ == 0) {
+    this->flows_[process.flow_].add_airtime(airtime, now);
+  }
+  for (size_t i = 0; i < process.nb_ids_; ++i) {
+    if (std::find(process.flows_, process.flows_ + i, process.flows_[i]) == process.flows_ + i) {
+      this->flows_[process.flows_[i]].add_airtime(airtime, now);
+    }
+  }
+  slot.on_air_time_ = now;
+}
+
+// Shorten the slot of the advertising packet scheduled the latest, if after the new packet, and no slot is free
+void BleAdvHandler::preempt_for(const BleAdvProcess & packet) {
+  uint32_t now = millis();
+  AdvSlot * preempted = nullptr;
+  for (auto & slot : this->slots_) {
+    if (slot.state_ == AdvState::IDLE) return;
+    if ((slot.state_ != AdvState::ADVERTISING) || slot.expired_) continue;
+    this->update_airtime(slot);
+    const BleAdvProcess & current = this->packets_[slot.packet_];
+    if (!this->is_before(packet, current, now)) continue;
+    if ((preempted == nullptr) || this->is_before(this->packets_[preempted->packet_], current, now)) {
+      preempted = &slot;
+    }
+  }
+  if (preempted != nullptr) {
+    // the switch is done by on_packets_changed, as for an expired slot
+    this->disarm_slot_timer(*preempted);
+    preempted->expired_ = true;
+  }
+}
+
+// Re evaluate the slots once packets were added or removed: the idle slots start advertising,
+// and the expired slots switch if a packet is now scheduled before their current one
+void BleAdvHandler::on_packets_changed() {
+  for (auto & slot : this->slots_) {
+    if (slot.state_ == AdvState::IDLE) {
+      this->advertise_next(slot);
+    } else if ((slot.state_ == AdvState::ADVERTISING) && slot.expired_) {
+      this->switch_if_needed(slot);
+    }
+  }
+}
+
+void BleAdvHandler::advertise_next(AdvSlot & slot) {
+  this->clean_packets();
+  size_t index = this->select_packet(millis());
+  if (index == this->packets_.size()) return;
+  slot.adv_params_changed_ = false;
+  this->set_slot_state(slot, AdvState::STARTING);
+  this->arm_slot_timer(slot, ADV_EVENT_TIMEOUT);
+  this->start_packet(slot, index);
+}
+
+// Switch the slot from its current packet to the next one in case:
+// A packet waiting for a slot is scheduled before the current one OR the current packet was requested to be removed
+// With hot swap, only the advertising data is changed, else the advertising is stopped and restarted
+// If no switch is needed while packets are waiting, the order may change with the airtime, so the slot is checked
+// again after the packet duration. If none is waiting, it is only checked again when packets are added or removed.
+// Called from the slot timer task as well as from the main loop, under the advertiser lock
+bool BleAdvHandler::switch_if_needed(AdvSlot & slot) {
+  if (slot.state_ != AdvState::ADVERTISING) return false;
+  this->clean_packets();
+  this->update_airtime(slot);
+  BleAdvProcess & process = this->packets_[slot.packet_];
+  size_t next = this->select_packet(slot.on_air_time_);
+  bool waiting = (next < this->packets_.size());
+  if (!process.to_be_removed_ && !(waiting && this->is_before(this->packets_[next], process, slot.on_air_time_))) {
+    if (waiting) {
+      this->arm_slot_timer(slot, process.param_.duration_);
+    }
+    return false;
+  }
+
+  if (!this->hot_swap_ || !waiting || slot.adv_params_changed_) {
+    this->set_slot_state(slot, AdvState::STOPPING);
+    this->arm_slot_timer(slot, ADV_EVENT_TIMEOUT);
+    this->backend_->stop(slot.index_);
+    return true;
+  }
+
+  this->set_slot_state(slot, AdvState::SWAPPING);
+  this->arm_slot_timer(slot, ADV_EVENT_TIMEOUT);
+  process.advertising_ = false;
+  if (process.to_be_removed_) {
+    this->release_packet(process);
+  }
+  this->start_packet(slot, next);
+  return true;
+}
+
+// The timer is stopped before being started again, as esp_timer_start_once fails on a running timer
+void BleAdvHandler::arm_slot_timer(AdvSlot & slot, uint32_t delay) {
+  esp_timer_stop(slot.timer_);
+  slot.timer_deadline_ = esp_timer_get_time() + (int64_t) delay * 1000;
+  esp_timer_start_once(slot.timer_, (uint64_t) delay * 1000);
+}
+
+void BleAdvHandler::disarm_slot_timer(AdvSlot & slot) {
+  esp_timer_stop(slot.timer_);
+  slot.timer_deadline_ = INT64_MAX;
+}
+
+// No completion event received from the backend: reset the slot and go on with the next packet
+void BleAdvHandler::on_slot_timeout(AdvSlot & slot) {
+  ESP_LOGW(TAG, "No GAP event received on slot %zu, advertising reset", slot.index_);
+  this->backend_->reset(slot.index_);
+  this->packets_[slot.packet_].advertising_ = false;
+  this->set_slot_state(slot, AdvState::IDLE);
+  this->advertise_next(slot);
+}
+
+void BleAdvHandler::on_slot_timer(void * arg) {
+  AdvSlot * slot = static_cast< AdvSlot * >(arg);
+  BleAdvHandler * handler = slot->handler_;
+  LockGuard lock(handler->adv_mutex_);
+  if (esp_timer_get_time() < slot->timer_deadline_) return;
+  slot->timer_deadline_ = INT64_MAX;
+  switch (slot->state_) {
+    case AdvState::IDLE:
+      // retry after a start failure
+      handler->advertise_next(*slot);
+      break;
+    case AdvState::ADVERTISING:
+      slot->expired_ = true;
+      handler->switch_if_needed(*slot);
+      break;
+    default:
+      handler->on_slot_timeout(*slot);
+      break;
+  }
+}
+
+void BleAdvHandler::gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) {
+  LockGuard lock(this->adv_mutex_);
+  this->backend_->gap_event_handler(event, param);
+}
+
+// Called by the backend from the GAP event handler, under the advertiser lock
+void BleAdvHandler::on_slot_started(size_t index, bool success) {
+  AdvSlot & slot = this->slots_[index];
+  if ((slot.state_ != AdvState::STARTING) && (slot.state_ != AdvState::SWAPPING)) return;
+  if (!success) {
+    ESP_LOGW(TAG, "Advertising failed on slot %zu", index);
+    if (slot.state_ == AdvState::STARTING) {
+      this->packets_[slot.packet_].advertising_ = false;
+      this->set_slot_state(slot, AdvState::IDLE);
+      this->arm_slot_timer(slot, ADV_RETRY_DELAY);
+    } else {
+      // the previous data may still be on air
+      this->set_slot_state(slot, AdvState::STOPPING);
+      this->arm_slot_timer(slot, ADV_EVENT_TIMEOUT);
+      this->backend_->stop(index);
     }
+    return;
+  }
+  // the airtime of the packet starts now
+  BleAdvProcess & process = this->packets_[slot.packet_];
+  this->set_slot_state(slot, AdvState::ADVERTISING);
+  slot.on_air_time_ = slot.state_time_;
+  if (process.first_air_time_ == 0) {
+    process.first_air_time_ = slot.state_time_;
   }
+  this->arm_slot_timer(slot, process.param_.duration_);
+}
+
+void BleAdvHandler::on_slot_stopped(size_t index) {
+  AdvSlot & slot = this->slots_[index];
+  if (slot.state_ != AdvState::STOPPING) return;
+  BleAdvProcess & process = this->packets_[slot.packet_];
+  process.advertising_ = false;
+  if (process.in_use_ && process.to_be_removed_) {
+    this->release_packet(process);
+  }
+  // advertise the next packet straight away
+  this->disarm_slot_timer(slot);
+  this->set_slot_state(slot, AdvState::IDLE);
+  this->advertise_next(slot);
 }
 
 void BleAdvSelect::control(const std::string &value) {
@@ -403,6 +1262,10 @@ void BleAdvDevice::refresh_encoder(std::string id, size_t index) {
   if (index == 0) {
     // "All" encoder selected, refresh from list, avoiding "All"
     for (auto & aid : this->select_encoding_.traits.get_options()) {
+      if (this->encoders_.size() == MAX_VARIANTS) {
+        ESP_LOGW(TAG, "Only the first %zu variants are used", MAX_VARIANTS);
+        break;
+      }
       if (aid != id) {
         this->encoders_.push_back(this->get_parent()->get_encoder(aid));
       }
@@ -5,15 +5,22 @@
 #include "esphome/core/entity_base.h"
 #include "esphome/core/helpers.h"
 #include "esphome/core/preferences.h"
+#include "esphome/core/log.h"
+#ifdef USE_LOGGER
+#include "esphome/components/logger/logger.h"
+#endif
 #ifdef USE_API
 #include "esphome/components/api/custom_api_device.h"
 #endif
 #include "esphome/components/select/select.h"
 #include "esphome/components/number/number.h"
+#include "esphome/components/esp32_ble/ble.h"
 
 #include <esp_gap_ble_api.h>
+#include <esp_timer.h>
+#include <memory>
 #include <vector>
-#include <list>
+#include <initializer_list>
 
 namespace esphome {
 
@@ -42,6 +49,8 @@ enum CommandType {
   FAN_DIR = 34,
   FAN_OSC = 35,
 };
+// Number of command types, NOCMD and CUSTOM excepted
+static constexpr size_t NB_COMMAND_TYPES = 13;
 
 /**
   Controller Parameters
@@ -55,6 +64,129 @@ struct ControllerParam_t {
 
 static constexpr size_t MAX_PACKET_LEN = 31;
 
+/**
+  Crc16Table: table driven CRC16, the table being generated at compile time
+    REFLECTED: LSB first, with reversed polynomial, as 'esphome::crc16'
+    else: MSB first, as 'esphome::crc16be'
+  No input / output inversion is done here, it is the responsibility of the caller.
+ */
+template < uint16_t POLY, bool REFLECTED >
+class Crc16Table
+{
+public:
+  constexpr Crc16Table(): table_() {
+    for (uint16_t i = 0; i < 256; ++i) {
+      uint16_t crc = REFLECTED ? i : (i << 8);
+      for (uint8_t j = 0; j < 8; ++j) {
+        if (REFLECTED) {
+          crc = (crc & 0x0001) ? ((crc >> 1) ^ POLY) : (crc >> 1);
+        } else {
+          crc = (crc & 0x8000) ? ((crc << 1) ^ POLY) : (crc << 1);
+        }
+      }
+      this->table_[i] = crc;
+    }
+  }
+
+  uint16_t compute(const uint8_t * buf, size_t len, uint16_t crc) const {
+    for (size_t i = 0; i < len; ++i) {
+      if (REFLECTED) {
+        crc = (crc >> 8) ^ this->table_[(crc ^ buf[i]) & 0xFF];
+      } else {
+        crc = (crc << 8) ^ this->table_[((crc >> 8) ^ buf[i]) & 0xFF];
+      }
+    }
+    return crc;
+  }
+
+protected:
+  uint16_t table_[256];
+};
+
+/**
+  FixedBytes: Fixed capacity byte sequence, for the small constant sequences of the encoders (header, mac, prefix)
+    Stored inline, no heap allocation, with the same read access as std::vector.
+ */
+template < size_t CAPACITY >
+class FixedBytes
+{
+public:
+  FixedBytes() = default;
+  FixedBytes(std::initializer_list< uint8_t > bytes) { this->assign(bytes.begin(), bytes.size()); }
+
+  void assign(const uint8_t * bytes, size_t len) {
+    this->size_ = std::min(len, CAPACITY);
+    std::copy(bytes, bytes + this->size_, this->data_);
+  }
+  void insert_front(uint8_t byte) {
+    if (this->size_ == CAPACITY) return;
+    std::copy_backward(this->data_, this->data_ + this->size_, this->data_ + this->size_ + 1);
+    this->data_[0] = byte;
+    this->size_++;
+  }
+
+  size_t size() const { return this->size_; }
+  bool empty() const { return this->size_ == 0; }
+  const uint8_t * data() const { return this->data_; }
+  const uint8_t * begin() const { return this->data_; }
+  const uint8_t * end() const { return this->data_ + this->size_; }
+  uint8_t operator[](size_t i) const { return this->data_[i]; }
+  bool operator==(const FixedBytes & other) const { return std::equal(this->begin(), this->end(), other.begin(), other.end()); }
+
+protected:
+  uint8_t data_[CAPACITY]{0};
+  uint8_t size_{0};
+};
+
+/**
+  FixedVector: Fixed capacity sequence of elements stored inline, no heap allocation
+    The elements are default constructed, only the first size() ones being meaningful.
+ */
+template < class T, size_t CAPACITY >
+class FixedVector
+{
+public:
+  size_t size() const { return this->size_; }
+  bool empty() const { return this->size_ == 0; }
+  bool full() const { return this->size_ == CAPACITY; }
+  T * begin() { return this->data_; }
+  T * end() { return this->data_ + this->size_; }
+  const T * begin() const { return this->data_; }
+  const T * end() const { return this->data_ + this->size_; }
+  T & front() { return this->data_[0]; }
+  T & back() { return this->data_[this->size_ - 1]; }
+  T & operator[](size_t i) { return this->data_[i]; }
+
+  // new default element at the end, nullptr if full
+  T * emplace_back() {
+    if (this->full()) return nullptr;
+    this->data_[this->size_] = T();
+    return &this->data_[this->size_++];
+  }
+  void pop_front() { this->erase(this->begin()); }
+  void erase(T * pos) {
+    std::move(pos + 1, this->end(), pos);
+    this->size_--;
+  }
+  template < class Pred > size_t remove_if(Pred pred) {
+    size_t size = std::remove_if(this->begin(), this->end(), pred) - this->begin();
+    std::swap(size, this->size_);
+    return size - this->size_;
+  }
+  void clear() { this->size_ = 0; }
+
+protected:
+  T data_[CAPACITY];
+  size_t size_{0};
+};
+
+static constexpr size_t MAX_HEADER_LEN = 6;
+using BleAdvHeader = FixedBytes< MAX_HEADER_LEN >;
+
+// CRC16 instances used by the encoders: reflected poly 0x8408 (Zhijia) and big endian poly 0x1021 (FanLamp)
+uint16_t crc16_le(const uint8_t * buf, size_t len, uint16_t crc);
+uint16_t crc16_be(const uint8_t * buf, size_t len, uint16_t crc);
+
 class BleAdvParam
 {
 public:
@@ -80,29 +212,221 @@ public:
   uint8_t get_full_len() { return this->len_; }
 
   bool operator==(const BleAdvParam & comp) { return std::equal(comp.buf_, comp.buf_ + MAX_PACKET_LEN, this->buf_); }
+  uint32_t hash() const;
 
-  uint32_t duration_{100};
+  // time advertised in one go, in ms
+  uint16_t duration_{100};
 
 protected:
+  // compact layout, no padding: the packets are stored in fixed size slabs
   uint8_t buf_[MAX_PACKET_LEN]{0};
-  size_t len_{0};
-  size_t ad_flag_index_{MAX_PACKET_LEN};
-  size_t data_index_{MAX_PACKET_LEN};
+  uint8_t len_{0};
+  uint8_t ad_flag_index_{MAX_PACKET_LEN};
+  uint8_t data_index_{MAX_PACKET_LEN};
 };
 
+// Max number of encoders used at once by a device, when all the variants of an encoding are selected
+static constexpr size_t MAX_VARIANTS = 4;
+// Packets of a message, one per encoder
+using BleAdvParams = FixedVector< BleAdvParam, MAX_VARIANTS >;
+
+/**
+  BleAdvSchedParam: Scheduling parameters of a message submitted to the Advertiser
+ */
+struct BleAdvSchedParam {
+  CommandType cmd_type_{CommandType::CUSTOM};
+  uint32_t min_tx_duration_{0}; // airtime targeted for the message, shared by its packets
+  uint32_t max_tx_duration_{0}; // max time the message stays in the Advertiser
+  const EntityBase * owner_{nullptr}; // controller submitting the message, the airtime being shared between them
+  uint8_t weight_{1}; // relative airtime share of the controller
+};
+
+/**
+  BleAdvProcess: Slot of the advertiser, allocated once and re used
+ */
 class BleAdvProcess
 {
 public:
-  BleAdvProcess(uint32_t id, BleAdvParam && param): param_(std::move(param)), id_(id) {}
   BleAdvParam param_;
-  uint32_t id_{0};
+  uint32_t hash_{0}; // hash of the payload, to share the identical packets
+  uint32_t seq_{0}; // insertion order, to find the oldest packet
+  bool in_use_{false};
   bool processed_once_{false};
   bool to_be_removed_{false};
+  bool advertising_{false}; // currently on air on an advertising slot
+
+  // scheduling: earliest deadline first until the target airtime is reached, then in turn
+  uint8_t priority_{0};
+  uint32_t added_time_{0};
+  uint32_t deadline_{0}; // time at which the target airtime should be reached
+  uint32_t target_airtime_{0};
+  uint32_t airtime_{0}; // achieved airtime, updated when the slot is switched
+  uint32_t first_air_time_{0}; // 0 if never on air
+  uint32_t served_seq_{0}; // order of the last start on a slot, to serve in turn
+  uint8_t flow_{0}; // airtime sharing flow of the first requester, used for the scheduling order
+
+  // ids of the messages requesting the packet, identical packets being shared: removed once all of them removed it
+  // Each requester counts the packet in the airtime sharing flow of its controller, and is charged its airtime.
+  static constexpr size_t MAX_REQUESTERS = 4;
+  uint16_t ids_[MAX_REQUESTERS]{0};
+  uint8_t flows_[MAX_REQUESTERS]{0};
+  uint8_t nb_ids_{0};
+  uint16_t get_id() const { return this->ids_[0]; }
+  bool has_requester(uint16_t msg_id) const;
+  // false if already a requester, or no room for one more
+  bool add_requester(uint16_t msg_id, uint8_t flow);
+  // the flow of the requester removed is given back
+  bool remove_requester(uint16_t msg_id, uint8_t & flow);
+};
 
-  // Only move operators to avoid data copy
-  BleAdvProcess(BleAdvProcess&&) = default;
-  BleAdvProcess& operator=(BleAdvProcess&&) = default;
-} ;
+// Check if a log of the given level could be emitted
+// To be used before building costly diagnostic strings: the log macros evaluate their args as soon as the level is compiled
+// Only the compiled level and the global runtime level are checked, the per tag level lookup building a std::string:
+// ESPHome does not allow a per tag level more verbose than the global one, so no log is lost.
+inline bool log_enabled(int level) {
+  if (level > ESPHOME_LOG_LEVEL) return false;
+#ifdef USE_LOGGER
+  if ((logger::global_logger != nullptr) && (logger::global_logger->get_log_level() < level)) return false;
+#endif
+  return true;
+}
+
+/**
+  BleAdvTrace: Binary trace of the packets requested for advertising and captured
+    Kept in a fixed size ring buffer, only the raw bytes are stored, the formatting is done when dumped on demand.
+ */
+class BleAdvTrace
+{
+public:
+  enum Event: uint8_t { ADV_START = 0, ADV_STOP = 1, CAPTURE = 2 };
+
+  void set_size(size_t size) { this->records_.resize(size); }
+  bool is_enabled() const { return !this->records_.empty(); }
+  void record(Event event, uint16_t msg_id, const uint8_t * buf = nullptr, size_t len = 0);
+  void dump(const char * tag) const;
+
+protected:
+  struct Record {
+    uint32_t time_;
+    uint16_t msg_id_;
+    Event event_;
+    uint8_t len_;
+    uint8_t buf_[MAX_PACKET_LEN];
+  };
+  std::vector< Record > records_;
+  size_t next_{0};
+  size_t count_{0};
+};
+
+/**
+  BleAdvCaptureQueue: Bounded queue of the captured raw packets, waiting to be decoded
+    The scan listener runs in the main loop as well: it only copies the raw packet, the decoding being done after it,
+    within a time budget per loop pass, so that a burst of captures does not delay the other components.
+ */
+class BleAdvCaptureQueue
+{
+public:
+  static constexpr size_t DEFAULT_SIZE = 16;
+  struct Record {
+    bool ignore_ble_param_;
+    uint8_t len_;
+    uint8_t buf_[MAX_PACKET_LEN];
+  };
+
+  // max number of records, rounded up to a power of 2 for the indexes to stay consistent when wrapping around
+  void set_size(size_t size);
+  size_t get_size() const { return this->records_.size(); }
+  // false if the queue is full
+  bool push(const uint8_t * buf, size_t len, bool ignore_ble_param);
+  // oldest record, nullptr if empty, to be released by pop once processed
+  const Record * front() const;
+  void pop() { this->tail_++; }
+  size_t size() const { return this->head_ - this->tail_; }
+
+protected:
+  std::vector< Record > records_ = std::vector< Record >(DEFAULT_SIZE);
+  size_t head_{0};
+  size_t tail_{0};
+};
+
+/**
+  BleAdvDedupTable: Fixed memory set of the fingerprints of the packets already captured, each one expiring after a given time
+    Set associative: the fingerprint selects a set of WAYS entries, the entry expiring first being evicted if the set is full.
+    The expiry is counted in time buckets of TICK_DURATION, never wrapping around in practice.
+ */
+class BleAdvDedupTable
+{
+public:
+  static constexpr size_t WAYS = 4;
+  static constexpr uint32_t TICK_DURATION = 1000;
+
+  // max number of entries, rounded up to a multiple of WAYS
+  void set_size(size_t size) { this->entries_.assign((size + WAYS - 1) / WAYS * WAYS, Entry()); }
+  size_t get_size() const { return this->entries_.size(); }
+  // true if the fingerprint was already added and is not expired, else added for rem_time seconds
+  bool find_or_add(uint32_t fingerprint, uint16_t rem_time, uint32_t now);
+  // forgets the fingerprint, for the packet to be accepted again when next captured
+  void remove(uint32_t fingerprint);
+  size_t get_occupancy(uint32_t now);
+
+  uint32_t nb_lookups_{0};
+  uint32_t nb_hits_{0};
+  uint32_t nb_evicted_{0};
+
+protected:
+  struct Entry {
+    uint32_t fingerprint_{0};
+    uint32_t expiry_{0}; // tick from which the entry is expired
+  };
+  std::vector< Entry > entries_;
+  uint32_t tick_{1};
+  uint32_t tick_start_{0};
+  void advance(uint32_t now);
+  bool is_live(const Entry & entry) const { return (int32_t)(entry.expiry_ - this->tick_) > 0; }
+};
+
+/**
+  BleAdvTimer: Deadline owned by a BleAdvTimerWheel, notified once reached
+ */
+class BleAdvTimer
+{
+public:
+  virtual void on_timer(uint32_t now) = 0;
+  bool is_armed() const { return this->armed_; }
+
+protected:
+  friend class BleAdvTimerWheel;
+  uint32_t deadline_{0};
+  bool armed_{false};
+  size_t bucket_{0};
+  BleAdvTimer * prev_{nullptr};
+  BleAdvTimer * next_{nullptr};
+};
+
+/**
+  BleAdvTimerWheel: Hashed timer wheel, waking only the timers having reached their deadline
+    Each timer is linked in the bucket of the tick following its deadline, the wheel going round as many times as needed.
+    The times are compared by difference, so that the wrap around of millis() after 49 days is supported.
+ */
+class BleAdvTimerWheel
+{
+public:
+  static constexpr uint32_t TICK = 10;
+  static constexpr size_t NB_BUCKETS = 32;
+
+  // (re)schedule the timer, a deadline already reached being notified at the next tick
+  void schedule(BleAdvTimer * timer, uint32_t deadline);
+  void cancel(BleAdvTimer * timer);
+  // notify the timers having reached their deadline, to be called regularly
+  void process(uint32_t now);
+  size_t get_nb_timers() const { return this->nb_timers_; }
+
+protected:
+  BleAdvTimer * buckets_[NB_BUCKETS]{nullptr};
+  size_t bucket_{0}; // bucket of the next tick
+  uint32_t tick_time_{0}; // time of the next tick
+  size_t nb_timers_{0};
+};
 
 class BleAdvGenCmd
 {
@@ -131,6 +455,41 @@ public:
   virtual void e2g_cmd(const BleAdvEncCmd & enc_cmd, BleAdvGenCmd & gen_cmd) const = 0;
 };
 
+class BleAdvEncoder;
+
+/**
+  BleAdvDecodeContext:
+    Per packet decoding context, shared by all the candidate decoders of a packet.
+    Memoizes the pre processed (de-whitened, bit reversed) data of the packet so that
+    the candidate decoders applying the same transformation only compute it once.
+ */
+class BleAdvDecodeContext
+{
+public:
+  BleAdvDecodeContext(const BleAdvParam & param): param_(param) {}
+  const BleAdvParam & get_param() const { return this->param_; }
+
+  // the data following the encoder header, pre processed as requested by the encoder
+  const uint8_t * get_data(const BleAdvEncoder & encoder);
+  // scratch buffer for decoders needing further transformation of the data
+  uint8_t * get_scratch() { return this->scratch_; }
+
+protected:
+  const BleAdvParam & param_;
+  uint8_t scratch_[MAX_PACKET_LEN]{0};
+
+  static constexpr size_t NB_SLOTS = 4;
+  struct Slot {
+    uint32_t preprocess_id_;
+    size_t offset_;
+    size_t len_;
+    bool reverse_;
+    uint8_t buf_[MAX_PACKET_LEN];
+  };
+  Slot slots_[NB_SLOTS];
+  size_t nb_slots_{0};
+};
+
 /**
   BleAdvEncoder: 
     Base class for encoders, for registration in the BleAdvHandler
@@ -149,23 +508,44 @@ public:
 
   void set_ble_param(uint8_t ad_flag, uint8_t adv_data_type){ this->ad_flag_ = ad_flag; this->adv_data_type_ = adv_data_type; }
   bool is_ble_param(uint8_t ad_flag, uint8_t adv_data_type) const { return this->ad_flag_ == ad_flag && this->adv_data_type_ == adv_data_type; }
-  void set_header(const std::vector< uint8_t > && header) { this->header_ = header; }
+  void set_header(const BleAdvHeader & header) { this->header_ = header; }
+  const BleAdvHeader & get_header() const { return this->header_; }
+  size_t get_data_len() const { return this->header_.size() + this->len_; }
   void set_translator(CommandTranslator * trans) { this->translator_ = trans; }
 
-  virtual void encode(std::vector< BleAdvParam > & params, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const;
-  virtual bool decode(const BleAdvParam & packet, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const;
-  virtual void translate_e2g(BleAdvGenCmd & gen_cmd, const BleAdvEncCmd & enc_cmd) const;
-  virtual void translate_g2e(std::vector< BleAdvEncCmd > & enc_cmds, const BleAdvGenCmd & gen_cmd) const;
+  // Pre processing applied at decoding to the data following the header: de-whitening then bit reversal
+  uint32_t get_preprocess_id() const { return this->preprocess_id_; }
+  bool is_reverse_on_decode() const { return this->reverse_on_decode_; }
+  void preprocess(uint8_t * buf) const;
+
+  // Common processing, non virtual: only the encoding specific steps below are virtual
+  void encode(BleAdvParam & param, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const;
+  bool decode(const BleAdvParam & packet, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const;
+  bool decode(BleAdvDecodeContext & ctx, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const;
+  void translate_e2g(BleAdvGenCmd & gen_cmd, const BleAdvEncCmd & enc_cmd) const;
+  // false if the command is not supported by the encoder
+  bool translate_g2e(BleAdvEncCmd & enc_cmd, const BleAdvGenCmd & gen_cmd) const;
   virtual std::string to_str(const BleAdvEncCmd & enc_cmd) const = 0;
 
 protected:
-  virtual bool decode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const = 0;
+  // Decoding in 2 steps, none of them altering the input data:
+  // - precheck: cheap structural checks on the raw data following the header, to discard the packet before any transformation
+  // - decode: full decoding of the pre processed data, the scratch buffer being available for further transformation
+  virtual bool precheck(const uint8_t* raw) const { return true; }
+  virtual bool decode(const uint8_t* buf, uint8_t* scratch, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const = 0;
   virtual void encode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const = 0;
 
   // utils for encoding
+  static uint8_t reverse_byte(uint8_t x);
   void reverse_all(uint8_t* buf, uint8_t len) const;
   void whiten(uint8_t *buf, size_t len, uint8_t seed) const;
 
+  // Whitening keystream cache: the seeds are fixed per encoder, so the LFSR output is computed
+  // once at construction and whitening / de-whitening is then a simple xor with the keystream
+  void add_whiten_key(size_t len, uint8_t seed);
+  void reset_whiten_key();
+  void apply_whiten_key(uint8_t *buf) const;
+
   // encoder identifiers
   std::string id_;
   std::string encoding_;
@@ -176,14 +556,57 @@ protected:
   uint8_t adv_data_type_{ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE};
 
   // Common parameters
-  std::vector< uint8_t > header_;
+  BleAdvHeader header_;
   size_t len_{0};
+  uint8_t whiten_key_[MAX_PACKET_LEN]{0};
+
+  // Identifies the whitening keystream, same for encoders built with the same seeds and lengths
+  uint32_t preprocess_id_{0};
+  bool reverse_on_decode_{false};
 
   // Translator
   CommandTranslator * translator_ = nullptr;
 };
 
-#define ENSURE_EQ(param1, param2, ...) if ((param1) != (param2)) { ESP_LOGD(this->id_.c_str(), __VA_ARGS__); return false; }
+#define ENSURE_EQ(param1, param2, ...) if ((param1) != (param2)) { \
+  if (log_enabled(ESPHOME_LOG_LEVEL_DEBUG)) { ESP_LOGD(this->id_.c_str(), __VA_ARGS__); } \
+  return false; }
+
+/**
+  BleAdvBackend: Interface of the Advertiser with the ESP BLE stack
+    It offers a fixed number of advertising slots, each one advertising a single packet at a time.
+    The requests are asynchronous, their completion being notified to the listener when the GAP events are received.
+ */
+class BleAdvBackend {
+public:
+  class Listener {
+  public:
+    // the packet requested on the slot is on air, or could not be
+    virtual void on_slot_started(size_t slot, bool success) = 0;
+    // the slot is no more advertising
+    virtual void on_slot_stopped(size_t slot) = 0;
+  };
+
+  virtual ~BleAdvBackend() = default;
+  virtual const char * get_name() const = 0;
+  virtual size_t get_nb_slots() const = 0;
+  virtual void setup() {}
+
+  void set_listener(Listener * listener) { this->listener_ = listener; }
+  // taken into account at the next start of each slot
+  virtual void set_adv_params(const esp_ble_adv_params_t & adv_params) { this->adv_params_ = adv_params; }
+
+  // Start advertising the packet on the slot, or only replace its data if the slot is already advertising
+  virtual void advertise(size_t slot, BleAdvParam & param) = 0;
+  virtual void stop(size_t slot) = 0;
+  // Stop the slot without notification, forgetting any request in progress
+  virtual void reset(size_t slot) = 0;
+  virtual void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) = 0;
+
+protected:
+  Listener * listener_{nullptr};
+  esp_ble_adv_params_t adv_params_{};
+};
 
 /**
   BleAdvHandler: Central class instanciated only ONCE
@@ -191,7 +614,7 @@ protected:
   It owns the centralized Advertiser allowing to advertise multiple messages at the same time 
     with handling of prioritization and parallel send when possible
  */
-class BleAdvHandler: public Component
+class BleAdvHandler: public Component, public esp32_ble::GAPEventHandler, public BleAdvBackend::Listener
 #ifdef USE_API
   , public api::CustomAPIDevice
 #endif
@@ -200,6 +623,7 @@ public:
   // component handling
   void setup() override;
   void loop() override;
+  void dump_config() override;
 
   // Encoder registration and access
   void add_encoder(BleAdvEncoder * encoder);
@@ -207,30 +631,162 @@ public:
   std::vector<std::string> get_ids(const std::string & encoding);
 
   // Advertiser
-  uint16_t add_to_advertiser(std::vector< BleAdvParam > & params);
+  void set_max_packets(size_t max_packets) { this->max_packets_ = max_packets; }
+  void set_hot_swap(bool hot_swap) { this->hot_swap_ = hot_swap; }
+  void set_max_adv_sets(size_t max_adv_sets) { this->max_adv_sets_ = max_adv_sets; }
+  // Backend selected at setup if none was set before: the extended one is opt-in, only used with max_adv_sets > 1
+  // on a stack supporting it, else the legacy one
+  void set_backend(std::unique_ptr< BleAdvBackend > backend) { this->backend_ = std::move(backend); }
+  void set_adv_params(const esp_ble_adv_params_t & adv_params);
+  uint16_t add_to_advertiser(BleAdvParams & params, const BleAdvSchedParam & sched);
   void remove_from_advertiser(uint16_t msg_id);
+  // airtime still needed by the message for each of its packets to be on air for at least its duration, 0 if reached
+  uint32_t get_min_airtime_left(uint16_t msg_id);
+
+  // Deadlines of the devices, woken from the main loop once reached
+  void schedule(BleAdvTimer * timer, uint32_t deadline) { this->timers_.schedule(timer, deadline); }
+  void cancel(BleAdvTimer * timer) { this->timers_.cancel(timer); }
+  void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) override;
+  void on_slot_started(size_t slot, bool success) override;
+  void on_slot_stopped(size_t slot) override;
 
   // identify which encoder is relevant for the param, decode and log Action and Controller parameters
   bool identify_param(const BleAdvParam & param, bool ignore_ble_param);
 
   // Listener
 #ifdef USE_ESP32_BLE_CLIENT
+  // only queues the raw packet if not captured in the last rem_time seconds, decoded after the scan processing
   void capture(const esp32_ble_tracker::ESPBTDevice & device, bool ignore_ble_param = true, uint16_t rem_time = 60);
 #endif
 
+  // Max number of captured packets remembered not to decode them again
+  void set_capture_dedup_size(size_t size) { this->capture_dedup_.set_size(size); }
+  // Max number of captured packets waiting to be decoded
+  void set_capture_queue_size(size_t size) { this->capture_queue_.set_size(size); }
+
+  // Trace of the advertised and captured packets, disabled if size is 0
+  void set_trace_size(size_t size) { this->trace_.set_size(size); }
+
 #ifdef USE_API
   // HA service to decode
   void on_raw_decode(std::string raw);
+  // HA service to dump the trace
+  void on_dump_trace();
 #endif
 
 protected:
   // ref to registered encoders
   std::vector< BleAdvEncoder * > encoders_;
 
-  // packets being advertised
-  std::list< BleAdvProcess > packets_;
+  // Decoding index: encoders grouped by data length and header, filled at encoder registration
+  // so that a packet is only submitted to the encoders having a chance to decode it.
+  // Several groups can match a packet as some headers are prefix of others.
+  struct DecodeGroup {
+    size_t data_len_;
+    BleAdvHeader header_;
+    std::vector< BleAdvEncoder * > encoders_;
+    bool match(const BleAdvParam & param) const;
+  };
+  std::vector< DecodeGroup > decode_index_;
+  bool identify_param(BleAdvDecodeContext & ctx, BleAdvEncoder * encoder);
+
+  // Decoding statistics
+  uint32_t nb_decode_packets_{0};
+  uint32_t nb_decode_candidates_{0};
+
+  // packets being advertised: fixed capacity slab allocated at setup, advertised in turn following a cursor
+  // when full, the oldest packet already advertised once is evicted, else the new packet is dropped
+  std::vector< BleAdvProcess > packets_;
+  size_t max_packets_{16};
+  size_t nb_packets_{0};
+  uint32_t packets_seq_{0};
+  BleAdvProcess * allocate_packet();
+  void release_packet(BleAdvProcess & packet);
+  BleAdvProcess * find_packet(const BleAdvParam & param, uint32_t hash);
+
+  // Scheduler: the packets still needing airtime before their deadline are served first, in earliest deadline order,
+  // the deadline being derived from the priority of the command and the tx durations, then all the packets are served in turn
+  enum Priority: uint8_t { PRIORITY_HIGH = 0, PRIORITY_MEDIUM = 1, PRIORITY_LOW = 2, NB_PRIORITIES = 3 };
+  static uint8_t get_priority(CommandType cmd_type);
+  static bool in_deadline_phase(const BleAdvProcess & packet, uint32_t now);
+  bool is_before(const BleAdvProcess & first, const BleAdvProcess & second, uint32_t now) const;
+  size_t select_packet(uint32_t now) const;
+  uint32_t served_seq_{0};
+
+  // Fair sharing of the airtime between the controllers in proportion of their weight: once the deadlines are handled,
+  // the packets of the controller having the lowest airtime divided by its weight are served first
+  static constexpr size_t WINDOW_BUCKETS = 10;
+  static constexpr uint32_t WINDOW_BUCKET_DURATION = 1000;
+  struct AdvFlow {
+    const EntityBase * owner_{nullptr};
+    uint8_t weight_{1};
+    size_t nb_packets_{0};
+    uint32_t vtime_{0}; // weighted airtime, compared with wrap around
+    // airtime over a sliding window
+    uint32_t window_[WINDOW_BUCKETS]{0};
+    size_t bucket_{0};
+    uint32_t bucket_start_{0};
+    void add_airtime(uint32_t airtime, uint32_t now);
+    uint32_t get_window_airtime(uint32_t now);
+    void advance(uint32_t now);
+  };
+  std::vector< AdvFlow > flows_;
+  uint8_t get_flow(const BleAdvSchedParam & sched);
+
+  // Advertiser statistics
+  size_t packets_high_water_{0};
+  uint32_t nb_packets_evicted_{0};
+  uint32_t nb_packets_dropped_{0};
+  uint32_t nb_packets_shared_{0};
+  uint32_t nb_target_met_[NB_PRIORITIES]{0};
+  uint32_t nb_target_missed_[NB_PRIORITIES]{0};
+
   uint16_t id_count = 1;
-  uint32_t adv_stop_time_ = 0;
+
+  BleAdvTimerWheel timers_;
+
+  // Advertising slots offered by the backend, each one advertising the packets in turn.
+  // State machine of a slot, driven by the backend completion events and its slot timer:
+  // IDLE -> advertise -> STARTING -> started / slot timer -> ADVERTISING
+  // -> slot timer expired and switch needed / stop -> STOPPING -> stopped / next packet -> IDLE
+  // With hot swap, the switch keeps advertising running and only changes the data:
+  // ADVERTISING -> slot timer expired and switch needed / advertise next -> SWAPPING -> started / slot timer -> ADVERTISING
+  // Nothing is polled: the slots are only re evaluated on their slot timer, on the backend completion events,
+  // and when packets are added or removed. The slot timer is armed for the packet duration while advertising,
+  // for the event timeout while waiting for a completion event, and for a retry delay after a start failure.
+  enum class AdvState: uint8_t { IDLE, STARTING, ADVERTISING, SWAPPING, STOPPING };
+  struct AdvSlot {
+    BleAdvHandler * handler_{nullptr};
+    size_t index_{0};
+    AdvState state_{AdvState::IDLE};
+    uint32_t state_time_{0};
+    size_t packet_{0};
+    uint32_t on_air_time_{0};
+    bool expired_{false};
+    bool adv_params_changed_{false};
+    esp_timer_handle_t timer_{nullptr};
+    // esp_timer_get_time() deadline of the armed slot timer: a callback firing before it was already
+    // waiting for the lock when the timer was stopped or re armed, and is ignored
+    int64_t timer_deadline_{INT64_MAX};
+  };
+  std::unique_ptr< BleAdvBackend > backend_;
+  std::vector< AdvSlot > slots_;
+  size_t max_adv_sets_{1};
+  bool hot_swap_{true};
+  // the slot timers run in their own task: protects the packets and the slots
+  Mutex adv_mutex_;
+  void set_slot_state(AdvSlot & slot, AdvState state);
+  void clean_packets();
+  void start_packet(AdvSlot & slot, size_t index);
+  void update_airtime(AdvSlot & slot);
+  void preempt_for(const BleAdvProcess & packet);
+  void advertise_next(AdvSlot & slot);
+  bool switch_if_needed(AdvSlot & slot);
+  void on_packets_changed();
+  void arm_slot_timer(AdvSlot & slot, uint32_t delay);
+  void disarm_slot_timer(AdvSlot & slot);
+  void on_slot_timeout(AdvSlot & slot);
+  static void on_slot_timer(void * arg);
 
   esp_ble_adv_params_t adv_params_ = {
     .adv_int_min = 0x20,
@@ -244,7 +800,19 @@ protected:
   };
 
   // Packets already captured once
-  std::list< BleAdvParam > listen_packets_;
+  BleAdvDedupTable capture_dedup_;
+
+#ifdef USE_ESP32_BLE_CLIENT
+  // Captured packets waiting to be decoded, and statistics
+  BleAdvCaptureQueue capture_queue_;
+  uint32_t nb_capture_processed_{0};
+  uint32_t nb_capture_dropped_{0};
+  size_t capture_queue_high_water_{0};
+  void process_captures();
+  void decode_capture(const BleAdvCaptureQueue::Record & record);
+#endif
+
+  BleAdvTrace trace_;
 };
 
 
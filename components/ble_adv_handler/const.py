@@ -1,3 +1,9 @@
 CONF_BLE_ADV_HANDLER_ID = "ble_adv_handler_id"
 CONF_BLE_ADV_ENCODING = "encoding"
 CONF_BLE_ADV_FORCED_ID = "forced_id"
+CONF_BLE_ADV_TRACE_SIZE = "trace_size"
+CONF_BLE_ADV_MAX_PACKETS = "max_packets"
+CONF_BLE_ADV_HOT_SWAP = "hot_swap"
+CONF_BLE_ADV_MAX_ADV_SETS = "max_adv_sets"
+CONF_BLE_ADV_CAPTURE_DEDUP_SIZE = "capture_dedup_size"
+CONF_BLE_ADV_CAPTURE_QUEUE_SIZE = "capture_queue_size"
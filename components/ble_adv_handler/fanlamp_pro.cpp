@@ -2,13 +2,79 @@
 #include "esphome/core/log.h"
 #include <arpa/inet.h>
 
+#ifdef USE_ESP32
+// Hardware AES accelerator through the mbedtls alternate implementation
 #define MBEDTLS_AES_ALT
 #include <aes_alt.h>
+#define AES_ENCRYPT_MODE ESP_AES_ENCRYPT
+#else
+// Software implementation
+#include <mbedtls/aes.h>
+#define AES_ENCRYPT_MODE MBEDTLS_AES_ENCRYPT
+#endif
 
 namespace esphome {
 namespace ble_adv_handler {
 
-FanLampEncoder::FanLampEncoder(const std::string & encoding, const std::string & variant, const std::vector<uint8_t> & prefix):
+/**
+  FanLampSigner: AES signing engine shared by all FanLampEncoderV2
+    The AES context is initialized once and kept, and as only 3 bytes of the key
+    are variable (seed low / high and tx_count), the key is only re loaded when they change.
+    They do not change when the same packet is checked by several candidate decoders
+    or re encoded after decoding.
+ */
+class FanLampSigner
+{
+public:
+  FanLampSigner() { mbedtls_aes_init(&this->aes_ctx_); }
+  ~FanLampSigner() { mbedtls_aes_free(&this->aes_ctx_); }
+
+  uint16_t sign(const uint8_t* buf, uint8_t tx_count, uint16_t seed) {
+    uint8_t seed_low = seed & 0xff;
+    uint8_t seed_high = (seed >> 8) & 0xff;
+    if (!this->key_loaded_ || this->key_[0] != seed_low || this->key_[1] != seed_high || this->key_[2] != tx_count) {
+      this->key_[0] = seed_low;
+      this->key_[1] = seed_high;
+      this->key_[2] = tx_count;
+      mbedtls_aes_setkey_enc(&this->aes_ctx_, this->key_, sizeof(this->key_)*8);
+      this->key_loaded_ = true;
+    }
+    uint8_t aes_out[16];
+    mbedtls_aes_crypt_ecb(&this->aes_ctx_, AES_ENCRYPT_MODE, buf, aes_out);
+    uint16_t sign = 0;
+    std::memcpy(&sign, aes_out, sizeof(sign));
+    return sign == 0 ? 0xffff : sign;
+  }
+
+protected:
+  mbedtls_aes_context aes_ctx_;
+  uint8_t key_[16] = {0, 0, 0, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16};
+  bool key_loaded_{false};
+};
+
+static FanLampSigner fanlamp_signer;
+
+// Whitening boxes of FanLampEncoderV2
+static constexpr uint8_t XBOXES[128] = {
+  0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC,
+  0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+  0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A,
+  0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+  0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85,
+  0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+  0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5,
+  0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+  0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C,
+  0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+  0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9,
+  0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+  0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94,
+  0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+  0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68,
+  0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
+};
+
+FanLampEncoder::FanLampEncoder(const std::string & encoding, const std::string & variant, const Prefix & prefix):
          BleAdvEncoder(encoding, variant), prefix_(prefix) {
 }
 
@@ -16,16 +82,20 @@ uint16_t FanLampEncoder::get_seed(uint16_t forced_seed) const {
   return (forced_seed == 0) ? (uint16_t) rand() % 0xFFF5 : forced_seed;
 }
 
-uint16_t FanLampEncoder::crc16(uint8_t* buf, size_t len, uint16_t seed) const {
-  return esphome::crc16be(buf, len, seed);
+uint16_t FanLampEncoder::crc16(const uint8_t* buf, size_t len, uint16_t seed) const {
+  return crc16_be(buf, len, seed);
 }
 
 FanLampEncoderV1::FanLampEncoderV1(const std::string & encoding, const std::string & variant, uint8_t pair_arg3,
                                     bool pair_arg_only_on_pair, bool xor1, uint8_t supp_prefix):
           FanLampEncoder(encoding, variant, {0xAA, 0x98, 0x43, 0xAF, 0x0B, 0x46, 0x46, 0x46}), pair_arg3_(pair_arg3), pair_arg_only_on_pair_(pair_arg_only_on_pair), 
               with_crc2_(supp_prefix == 0x00), xor1_(xor1) {
-  if (supp_prefix != 0x00) this->prefix_.insert(this->prefix_.begin(), supp_prefix);
+  if (supp_prefix != 0x00) this->prefix_.insert_front(supp_prefix);
   this->len_ = this->prefix_.size() + sizeof(data_map_t) + (this->with_crc2_ ? 2 : 1);
+  this->add_whiten_key(this->len_, 0x6F);
+  this->reverse_on_decode_ = true;
+  // crc of the constant MAC part of the prefix, used as seed of crc16_2
+  this->crc16_mac_ = this->with_crc2_ ? this->crc16(this->prefix_.data() + 1, 5, 0xffff) : 0;
 }
 
 std::string FanLampEncoderV1::to_str(const BleAdvEncCmd & enc_cmd) const {
@@ -35,36 +105,45 @@ std::string FanLampEncoderV1::to_str(const BleAdvEncCmd & enc_cmd) const {
   return ret;
 }
 
-bool FanLampEncoderV1::decode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const {
-  this->whiten(buf, this->len_, 0x6F);
-  this->reverse_all(buf, this->len_);
-
-  uint8_t data_start = this->prefix_.size();
-  data_map_t * data = (data_map_t *) (buf + data_start);
+// de-whiten and reverse a single byte of the raw data
+uint8_t FanLampEncoderV1::plain_byte(const uint8_t* raw, size_t pos) const {
+  return reverse_byte(raw[pos] ^ this->whiten_key_[pos]);
+}
 
+bool FanLampEncoderV1::precheck(const uint8_t* raw) const {
   // distinguish in between different encoder variants
-  if(!std::equal(this->prefix_.begin(), this->prefix_.end(), buf)) return false;
-  if (data->cmd == 0x28 && this->pair_arg3_ != data->args[2]) return false;
-  if (data->cmd != 0x28 && !this->pair_arg_only_on_pair_ && data->args[2] != this->pair_arg3_) return false;
-  if (data->cmd != 0x28 && this->pair_arg_only_on_pair_ && data->args[2] != 0) return false;
+  for (size_t i = 0; i < this->prefix_.size(); ++i) {
+    if (this->plain_byte(raw, i) != this->prefix_[i]) return false;
+  }
+  size_t data_start = this->prefix_.size();
+  uint8_t cmd = this->plain_byte(raw, data_start + offsetof(data_map_t, cmd));
+  uint8_t arg3 = this->plain_byte(raw, data_start + offsetof(data_map_t, args) + 2);
+  if (cmd == 0x28 && this->pair_arg3_ != arg3) return false;
+  if (cmd != 0x28 && !this->pair_arg_only_on_pair_ && arg3 != this->pair_arg3_) return false;
+  if (cmd != 0x28 && this->pair_arg_only_on_pair_ && arg3 != 0) return false;
+  return true;
+}
+
+bool FanLampEncoderV1::decode(const uint8_t* buf, uint8_t* scratch, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const {
+  uint8_t data_start = this->prefix_.size();
+  const data_map_t * data = (const data_map_t *) (buf + data_start);
 
-  std::string decoded = esphome::format_hex_pretty(buf, this->len_);
   uint16_t seed = htons(data->seed);
   uint8_t seed8 = static_cast<uint8_t>(seed & 0xFF);
-  ENSURE_EQ(data->r2, this->xor1_ ? seed8 ^ 1 : seed8, "Decoded KO (r2) - %s", decoded.c_str());
+  ENSURE_EQ(data->r2, this->xor1_ ? seed8 ^ 1 : seed8, "Decoded KO (r2) - %s", esphome::format_hex_pretty(buf, this->len_).c_str());
 
-  uint16_t crc16 = htons(this->crc16((uint8_t*)(data), sizeof(data_map_t) - 2, ~seed));
-  ENSURE_EQ(crc16, data->crc16, "Decoded KO (crc16) - %s", decoded.c_str());
+  uint16_t crc16 = htons(this->crc16((const uint8_t*)(data), sizeof(data_map_t) - 2, ~seed));
+  ENSURE_EQ(crc16, data->crc16, "Decoded KO (crc16) - %s", esphome::format_hex_pretty(buf, this->len_).c_str());
 
   if (data->args[2] != 0) {
-    ENSURE_EQ(data->args[2], this->pair_arg3_, "Decoded KO (arg3) - %s", decoded.c_str());
+    ENSURE_EQ(data->args[2], this->pair_arg3_, "Decoded KO (arg3) - %s", esphome::format_hex_pretty(buf, this->len_).c_str());
   }
 
   if (this->with_crc2_) {
-    uint16_t crc16_mac = this->crc16(buf + 1, 5, 0xffff);
-    uint16_t crc16_2 = htons(this->crc16(buf + data_start, sizeof(data_map_t), crc16_mac));
-    uint16_t crc16_data_2 = *(uint16_t*) &buf[this->len_ - 2];
-    ENSURE_EQ(crc16_data_2, crc16_2, "Decoded KO (crc16_2) - %s", decoded.c_str());
+    uint16_t crc16_2 = htons(this->crc16(buf + data_start, sizeof(data_map_t), this->crc16_mac_));
+    uint16_t crc16_data_2 = 0;
+    std::memcpy(&crc16_data_2, &buf[this->len_ - 2], sizeof(crc16_data_2));
+    ENSURE_EQ(crc16_data_2, crc16_2, "Decoded KO (crc16_2) - %s", esphome::format_hex_pretty(buf, this->len_).c_str());
   }
 
   uint8_t rem_id = data->src ^ seed8;
@@ -107,18 +186,17 @@ void FanLampEncoderV1::encode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerPa
   data->crc16 = htons(this->crc16((uint8_t*)(data), sizeof(data_map_t) - 2, ~seed));
   
   if (this->with_crc2_) {
-    uint16_t* crc16_2 = (uint16_t*) &buf[this->len_ - 2];
-    uint16_t crc_mac = this->crc16(buf + 1, 5, 0xffff);
-    *crc16_2 = htons(this->crc16((uint8_t*)(data), sizeof(data_map_t), crc_mac));
+    uint16_t crc16_2 = htons(this->crc16((uint8_t*)(data), sizeof(data_map_t), this->crc16_mac_));
+    std::memcpy(&buf[this->len_ - 2], &crc16_2, sizeof(crc16_2));
   } else {
     buf[this->len_ - 1] = 0xAA;
   }
 
   this->reverse_all(buf, this->len_);
-  this->whiten(buf, this->len_, 0x6F);
+  this->apply_whiten_key(buf);
 }
 
-FanLampEncoderV2::FanLampEncoderV2(const std::string & encoding, const std::string & variant, const std::vector<uint8_t> && prefix, uint16_t device_type, bool with_sign):
+FanLampEncoderV2::FanLampEncoderV2(const std::string & encoding, const std::string & variant, const Prefix & prefix, uint16_t device_type, bool with_sign):
   FanLampEncoder(encoding, variant, prefix), device_type_(device_type), with_sign_(with_sign) {
   this->len_ = this->prefix_.size() + sizeof(data_map_t);
 }
@@ -129,64 +207,53 @@ std::string FanLampEncoderV2::to_str(const BleAdvEncCmd & enc_cmd) const {
   return ret;
 }
 
-uint16_t FanLampEncoderV2::sign(uint8_t* buf, uint8_t tx_count, uint16_t seed) const {
-  uint8_t sigkey[16] = {0, 0, 0, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16};
-  
-  sigkey[0] = seed & 0xff;
-  sigkey[1] = (seed >> 8) & 0xff;
-  sigkey[2] = tx_count;
-  mbedtls_aes_context aes_ctx;
-  mbedtls_aes_init(&aes_ctx);
-  mbedtls_aes_setkey_enc(&aes_ctx, sigkey, sizeof(sigkey)*8);
-  uint8_t aes_in[16], aes_out[16];
-  memcpy(aes_in, buf, 16);
-  mbedtls_aes_crypt_ecb(&aes_ctx, ESP_AES_ENCRYPT, aes_in, aes_out);
-  mbedtls_aes_free(&aes_ctx);
-  uint16_t sign = ((uint16_t*) aes_out)[0]; 
-  return sign == 0 ? 0xffff : sign;
+uint16_t FanLampEncoderV2::sign(const uint8_t* buf, uint8_t tx_count, uint16_t seed) const {
+  return fanlamp_signer.sign(buf, tx_count, seed);
 }
 
 void FanLampEncoderV2::whiten(uint8_t *buf, uint8_t size, uint8_t seed, uint8_t salt) const {
-  static constexpr uint8_t XBOXES[128] = {
-    0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC,
-    0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
-    0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A,
-    0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
-    0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85,
-    0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
-    0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5,
-    0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
-    0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C,
-    0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
-    0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9,
-    0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
-    0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94,
-    0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
-    0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68,
-    0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
-  };
-
   for (uint8_t i = 0; i < size; ++i) {
     buf[i] ^= XBOXES[((seed + i + 9) & 0x1f) + (salt & 0x3) * 0x20];
     buf[i] ^= seed;
   }
 }
 
-bool FanLampEncoderV2::decode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const {
-  data_map_t * data = (data_map_t *) (buf + this->prefix_.size());
-  uint16_t crc16 = this->crc16(buf , this->len_ - 2, ~(data->seed));
+// de-whiten a single byte of the raw data, the first 2 and last 4 bytes not being whitened
+uint8_t FanLampEncoderV2::plain_byte(const uint8_t* raw, size_t pos, uint8_t seed) const {
+  if (pos < 2 || pos >= this->len_ - 4) return raw[pos];
+  uint8_t i = pos - 2;
+  return raw[pos] ^ XBOXES[(seed + i + 9) & 0x1f] ^ seed;
+}
+
+bool FanLampEncoderV2::precheck(const uint8_t* raw) const {
+  // the seed is not whitened, only the bytes needed to distinguish the variants are de-whitened
+  size_t data_start = this->prefix_.size();
+  const data_map_t * raw_data = (const data_map_t *) (raw + data_start);
+  uint8_t seed = (uint8_t)(raw_data->seed);
+  for (size_t i = 0; i < this->prefix_.size(); ++i) {
+    if (this->plain_byte(raw, i, seed) != this->prefix_[i]) return false;
+  }
+  size_t type_pos = data_start + offsetof(data_map_t, type);
+  uint16_t type = this->plain_byte(raw, type_pos, seed) | (this->plain_byte(raw, type_pos + 1, seed) << 8);
+  if (type != this->device_type_) return false;
+  size_t sign_pos = data_start + offsetof(data_map_t, sign);
+  bool has_sign = (this->plain_byte(raw, sign_pos, seed) != 0) || (this->plain_byte(raw, sign_pos + 1, seed) != 0);
+  if (this->with_sign_ != has_sign) return false;
+  return true;
+}
+
+bool FanLampEncoderV2::decode(const uint8_t* buf, uint8_t* scratch, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const {
+  const data_map_t * raw_data = (const data_map_t *) (buf + this->prefix_.size());
+  uint16_t crc16 = this->crc16(buf , this->len_ - 2, ~(raw_data->seed));
 
-  this->whiten(buf + 2, this->len_ - 6, (uint8_t)(data->seed), 0);
-  if (!std::equal(this->prefix_.begin(), this->prefix_.end(), buf)) return false;
-  if (data->type != this->device_type_) return false;
-  if (this->with_sign_ && data->sign == 0x0000) return false;
-  if (!this->with_sign_ && data->sign != 0x0000) return false;
+  std::copy(buf, buf + this->len_, scratch);
+  this->whiten(scratch + 2, this->len_ - 6, (uint8_t)(raw_data->seed), 0);
+  const data_map_t * data = (const data_map_t *) (scratch + this->prefix_.size());
 
-  std::string decoded = esphome::format_hex_pretty(buf, this->len_);
-  ENSURE_EQ(crc16, data->crc16, "Decoded KO (crc16) - %s", decoded.c_str());
+  ENSURE_EQ(crc16, data->crc16, "Decoded KO (crc16) - %s", esphome::format_hex_pretty(scratch, this->len_).c_str());
 
   if (this->with_sign_) {
-    ENSURE_EQ(this->sign(buf + 1, data->tx_count, data->seed), data->sign, "Decoded KO (sign) - %s", decoded.c_str());
+    ENSURE_EQ(this->sign(scratch + 1, data->tx_count, data->seed), data->sign, "Decoded KO (sign) - %s", esphome::format_hex_pretty(scratch, this->len_).c_str());
   }
 
   enc_cmd.cmd = data->cmd;
@@ -8,17 +8,20 @@ namespace ble_adv_handler {
 class FanLampEncoder: public BleAdvEncoder
 {
 public:
-  FanLampEncoder(const std::string & encoding, const std::string & variant, const std::vector<uint8_t> & prefix);
+  static constexpr size_t MAX_PREFIX_LEN = 9;
+  using Prefix = FixedBytes< MAX_PREFIX_LEN >;
+
+  FanLampEncoder(const std::string & encoding, const std::string & variant, const Prefix & prefix);
 
 protected:
 
   uint16_t get_seed(uint16_t forced_seed = 0) const;
-  uint16_t crc16(uint8_t* buf, size_t len, uint16_t seed) const;
+  uint16_t crc16(const uint8_t* buf, size_t len, uint16_t seed) const;
 
-  std::vector<uint8_t> prefix_;
+  Prefix prefix_;
 };
 
-class FanLampEncoderV1: public FanLampEncoder
+class FanLampEncoderV1 final: public FanLampEncoder
 {
 public:
   FanLampEncoderV1(const std::string & encoding, const std::string & variant,
@@ -38,20 +41,24 @@ protected:
     uint16_t crc16;
   }__attribute__((packed, aligned(1)));
 
-  virtual bool decode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override;
+  virtual bool precheck(const uint8_t* raw) const override;
+  virtual bool decode(const uint8_t* buf, uint8_t* scratch, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override;
   virtual void encode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override;
   virtual std::string to_str(const BleAdvEncCmd & enc_cmd) const override;
 
+  uint8_t plain_byte(const uint8_t* raw, size_t pos) const;
+
   uint8_t pair_arg3_;
   bool pair_arg_only_on_pair_;
   bool with_crc2_;
   bool xor1_;
+  uint16_t crc16_mac_;
 };
 
-class FanLampEncoderV2: public FanLampEncoder
+class FanLampEncoderV2 final: public FanLampEncoder
 {
 public:
-  FanLampEncoderV2(const std::string & encoding, const std::string & variant, const std::vector<uint8_t> && prefix, uint16_t device_type, bool with_sign);
+  FanLampEncoderV2(const std::string & encoding, const std::string & variant, const Prefix & prefix, uint16_t device_type, bool with_sign);
 
 protected:
   static constexpr size_t ARGS_LEN = 2;
@@ -70,12 +77,14 @@ protected:
     uint16_t crc16;
   }__attribute__((packed, aligned(1)));
 
-  virtual bool decode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override;
+  virtual bool precheck(const uint8_t* raw) const override;
+  virtual bool decode(const uint8_t* buf, uint8_t* scratch, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override;
   virtual void encode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override;
   virtual std::string to_str(const BleAdvEncCmd & enc_cmd) const override;
 
-  uint16_t sign(uint8_t* buf, uint8_t tx_count, uint16_t seed) const;
+  uint16_t sign(const uint8_t* buf, uint8_t tx_count, uint16_t seed) const;
   void whiten(uint8_t *buf, uint8_t size, uint8_t seed, uint8_t salt = 0) const;
+  uint8_t plain_byte(const uint8_t* raw, size_t pos, uint8_t seed) const;
 
   uint16_t device_type_;
   bool with_sign_;
@@ -10,8 +10,17 @@ std::string ZhijiaEncoder::to_str(const BleAdvEncCmd & enc_cmd) const {
   return ret;
 }
 
-uint16_t ZhijiaEncoder::crc16(uint8_t* buf, size_t len, uint16_t seed) const {
-  return esphome::crc16(buf, len, seed, 0x8408, true, true);
+uint16_t ZhijiaEncoder::crc16(const uint8_t* buf, size_t len, uint16_t seed) const {
+  // same as esphome::crc16(buf, len, seed, 0x8408, true, true)
+  return crc16_le(buf, len, seed ^ 0xFFFF) ^ 0xFFFF;
+}
+
+// The address is the mac in reversed order, each byte being bit reversed, then whitened
+bool ZhijiaEncoder::check_raw_addr(const uint8_t* raw, size_t addr_len) const {
+  for (size_t i = 0; i < addr_len; ++i) {
+    if ((raw[i] ^ this->whiten_key_[i]) != reverse_byte(this->mac_[addr_len - i - 1])) return false;
+  }
+  return true;
 }
 
 // {0xAB, 0xCD, 0xEF} => 0xABCDEF
@@ -30,24 +39,22 @@ void ZhijiaEncoder::id_to_uuid(uint8_t * uuid, uint32_t id, size_t len) const {
   }
 }
 
-ZhijiaEncoderV0::ZhijiaEncoderV0(const std::string & encoding, const std::string & variant, std::vector< uint8_t > && mac): 
+ZhijiaEncoderV0::ZhijiaEncoderV0(const std::string & encoding, const std::string & variant, const Mac & mac): 
   ZhijiaEncoder(encoding, variant, mac) {
   this->len_ = sizeof(data_map_t);
+  this->add_whiten_key(this->len_, 0x37);
+  this->add_whiten_key(this->len_, 0x7F);
 }
 
-bool ZhijiaEncoderV0::decode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const {
-  this->whiten(buf, this->len_, 0x37);
-  this->whiten(buf, this->len_, 0x7F);
+bool ZhijiaEncoderV0::precheck(const uint8_t* raw) const {
+  return this->check_raw_addr(raw, ADDR_LEN);
+}
 
-  data_map_t * data = (data_map_t *) buf;
+bool ZhijiaEncoderV0::decode(const uint8_t* buf, uint8_t* scratch, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const {
+  const data_map_t * data = (const data_map_t *) buf;
   uint16_t crc16 = this->crc16(buf, ADDR_LEN + TXDATA_LEN);
   ENSURE_EQ(crc16, data->crc16, "Decoded KO (CRC)");
 
-  uint8_t addr[ADDR_LEN];
-  this->reverse_all(buf, ADDR_LEN);
-  std::reverse_copy(data->addr, data->addr + ADDR_LEN, addr);
-  if (!std::equal(addr, addr + ADDR_LEN, this->mac_.begin())) return false;
-
   cont.tx_count_ = data->txdata[0] ^ data->txdata[6];
   enc_cmd.args[0] = cont.tx_count_ ^ data->txdata[7];
   uint8_t pivot = data->txdata[1] ^ enc_cmd.args[0];
@@ -82,31 +89,32 @@ void ZhijiaEncoderV0::encode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerPar
   data->txdata[7] = enc_cmd.args[0] ^ cont.tx_count_;
 
   data->crc16 = this->crc16(buf, ADDR_LEN + TXDATA_LEN);
-  this->whiten(buf, this->len_, 0x7F);
-  this->whiten(buf, this->len_, 0x37);
+  this->apply_whiten_key(buf);
 }
 
-ZhijiaEncoderV1::ZhijiaEncoderV1(const std::string & encoding, const std::string & variant, std::vector< uint8_t > && mac, uint8_t uid_start): 
+ZhijiaEncoderV1::ZhijiaEncoderV1(const std::string & encoding, const std::string & variant, const Mac & mac, uint8_t uid_start): 
   ZhijiaEncoder(encoding, variant, mac), uid_start_(uid_start) {
   this->len_ = sizeof(data_map_t);
+  this->add_whiten_key(this->len_, 0x37);
 }
 
-bool ZhijiaEncoderV1::decode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const {
-  this->whiten(buf, this->len_, 0x37);
+bool ZhijiaEncoderV1::precheck(const uint8_t* raw) const {
+  if (!this->check_raw_addr(raw, ADDR_LEN)) return false;
 
-  data_map_t * data = (data_map_t *) buf;
+  // dupe bytes, de-whitened one by one
+  const uint8_t * key = this->whiten_key_ + ADDR_LEN;
+  const uint8_t * txdata = raw + ADDR_LEN;
+  ENSURE_EQ(txdata[7] ^ key[7], txdata[14] ^ key[14], "Decoded KO (Dupe 7/14)");
+  ENSURE_EQ(txdata[8] ^ key[8], txdata[11] ^ key[11], "Decoded KO (Dupe 8/11)");
+  ENSURE_EQ(txdata[11] ^ key[11], txdata[16] ^ key[16], "Decoded KO (Dupe 11/16)");
+  return true;
+}
+
+bool ZhijiaEncoderV1::decode(const uint8_t* buf, uint8_t* scratch, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const {
+  const data_map_t * data = (const data_map_t *) buf;
   uint16_t crc16 = this->crc16(buf, ADDR_LEN + TXDATA_LEN);
   ENSURE_EQ(crc16, data->crc16, "Decoded KO (CRC)");
 
-  uint8_t addr[ADDR_LEN];
-  this->reverse_all(data->addr, ADDR_LEN);
-  std::reverse_copy(data->addr, data->addr + ADDR_LEN, addr);
-  if (!std::equal(addr, addr + ADDR_LEN, this->mac_.begin())) return false;
-
-  ENSURE_EQ(data->txdata[7], data->txdata[14], "Decoded KO (Dupe 7/14)");
-  ENSURE_EQ(data->txdata[8], data->txdata[11], "Decoded KO (Dupe 8/11)");
-  ENSURE_EQ(data->txdata[11], data->txdata[16], "Decoded KO (Dupe 11/16)");
-
   uint8_t pivot = data->txdata[16];
   uint8_t uid[UID_LEN];
   uid[0] = data->txdata[7] ^ pivot;
@@ -173,19 +181,31 @@ void ZhijiaEncoderV1::encode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerPar
   data->txdata[16] = pivot;
 
   data->crc16 = this->crc16(buf, ADDR_LEN + TXDATA_LEN);
-  this->whiten(buf, this->len_, 0x37);
+  this->apply_whiten_key(buf);
 }
 
-ZhijiaEncoderV2::ZhijiaEncoderV2(const std::string & encoding, const std::string & variant, std::vector< uint8_t > && mac): 
-  ZhijiaEncoderV1(encoding, variant, std::move(mac)) {
+ZhijiaEncoderV2::ZhijiaEncoderV2(const std::string & encoding, const std::string & variant, const Mac & mac): 
+  ZhijiaEncoderV1(encoding, variant, mac) {
   this->len_ = sizeof(data_map_t);
+  // reset the key computed by V1 for its own length
+  this->reset_whiten_key();
+  this->add_whiten_key(this->len_, 0x6F);
+  this->add_whiten_key(this->len_ - 2, 0xD3);
 }
 
-bool ZhijiaEncoderV2::decode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const {
-  this->whiten(buf, this->len_, 0x6F);
-  this->whiten(buf, this->len_ - 2, 0xD3);
+bool ZhijiaEncoderV2::precheck(const uint8_t* raw) const {
+  // mac bytes and null byte, de-whitened and un-pivoted one by one
+  const uint8_t * key = this->whiten_key_;
+  uint8_t pivot = raw[TXDATA_LEN] ^ key[TXDATA_LEN];
+  if ((raw[7] ^ key[7] ^ pivot) != this->mac_[0]) return false;
+  if ((raw[10] ^ key[10] ^ pivot) != this->mac_[1]) return false;
+  if ((raw[11] ^ key[11] ^ pivot) != 0x00) return false;
+  return true;
+}
 
-  data_map_t * data = (data_map_t *) buf;
+bool ZhijiaEncoderV2::decode(const uint8_t* buf, uint8_t* scratch, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const {
+  std::copy(buf, buf + this->len_, scratch);
+  data_map_t * data = (data_map_t *) scratch;
   for (size_t i = 0; i < TXDATA_LEN; ++i) {
     data->txdata[i] ^= data->pivot;
   }
@@ -216,7 +236,6 @@ bool ZhijiaEncoderV2::decode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerPar
   ENSURE_EQ(data->pivot, re_pivot, "Decoded KO (Pivot)");
 
   ENSURE_EQ(data->txdata[8], uuid[0] ^ cont.tx_count_ ^ enc_cmd.args[1] ^ addr[0], "Decoded KO (txdata 8)");
-  ENSURE_EQ(data->txdata[11], 0x00, "Decoded KO (txdata 11)");
   ENSURE_EQ(data->txdata[14], uuid[0] ^ cont.tx_count_ ^ enc_cmd.args[1] ^ enc_cmd.cmd, "Decoded KO (txdata 14)");
 
   return true;
@@ -254,8 +273,7 @@ void ZhijiaEncoderV2::encode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerPar
     data->txdata[i] ^= data->pivot;
   }
   
-  this->whiten(buf, this->len_ - 2, 0xD3);
-  this->whiten(buf, this->len_, 0x6F);
+  this->apply_whiten_key(buf);
 }
 
 } // namespace ble_adv_handler
@@ -8,23 +8,27 @@ namespace ble_adv_handler {
 class ZhijiaEncoder: public BleAdvEncoder
 {
 public:
-  ZhijiaEncoder(const std::string & encoding, const std::string & variant, std::vector< uint8_t > & mac): 
+  static constexpr size_t MAX_MAC_LEN = 4;
+  using Mac = FixedBytes< MAX_MAC_LEN >;
+
+  ZhijiaEncoder(const std::string & encoding, const std::string & variant, const Mac & mac): 
       BleAdvEncoder(encoding, variant), mac_(mac) {}
   
 protected:
   virtual std::string to_str(const BleAdvEncCmd & enc_cmd) const override;
 
-  uint16_t crc16(uint8_t* buf, size_t len, uint16_t seed = 0) const;
+  uint16_t crc16(const uint8_t* buf, size_t len, uint16_t seed = 0) const;
+  bool check_raw_addr(const uint8_t* raw, size_t addr_len) const;
   uint32_t uuid_to_id(uint8_t * uuid, size_t len) const;
   void id_to_uuid(uint8_t * uuid, uint32_t id, size_t len) const;
   
-  std::vector< uint8_t > mac_;
+  Mac mac_;
 };
 
-class ZhijiaEncoderV0: public ZhijiaEncoder
+class ZhijiaEncoderV0 final: public ZhijiaEncoder
 {
 public:
-  ZhijiaEncoderV0(const std::string & encoding, const std::string & variant, std::vector< uint8_t > && mac);
+  ZhijiaEncoderV0(const std::string & encoding, const std::string & variant, const Mac & mac);
   
 protected:
   static constexpr size_t UUID_LEN = 2;
@@ -36,14 +40,15 @@ protected:
     uint16_t crc16;
   }__attribute__((packed, aligned(1)));
 
-  virtual bool decode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override;
+  virtual bool precheck(const uint8_t* raw) const override;
+  virtual bool decode(const uint8_t* buf, uint8_t* scratch, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override;
   virtual void encode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override;
 };
 
 class ZhijiaEncoderV1: public ZhijiaEncoder
 {
 public:
-  ZhijiaEncoderV1(const std::string & encoding, const std::string & variant, std::vector< uint8_t > && mac, uint8_t uid_start = 0);
+  ZhijiaEncoderV1(const std::string & encoding, const std::string & variant, const Mac & mac, uint8_t uid_start = 0);
   
 protected:
   static constexpr size_t UID_LEN = 3;
@@ -56,16 +61,17 @@ protected:
     uint16_t crc16;
   }__attribute__((packed, aligned(1)));
 
-  virtual bool decode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override;
+  virtual bool precheck(const uint8_t* raw) const override;
+  virtual bool decode(const uint8_t* buf, uint8_t* scratch, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override;
   virtual void encode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override;
 
   uint8_t uid_start_;
 };
 
-class ZhijiaEncoderV2: public ZhijiaEncoderV1
+class ZhijiaEncoderV2 final: public ZhijiaEncoderV1
 {
 public:
-  ZhijiaEncoderV2(const std::string & encoding, const std::string & variant, std::vector< uint8_t > && mac);
+  ZhijiaEncoderV2(const std::string & encoding, const std::string & variant, const Mac & mac);
   
 protected:
   static constexpr size_t UUID_LEN = 3;
@@ -78,7 +84,8 @@ protected:
     uint8_t spare[SPARE_LEN];
   }__attribute__((packed, aligned(1)));
 
-  virtual bool decode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override;
+  virtual bool precheck(const uint8_t* raw) const override;
+  virtual bool decode(const uint8_t* buf, uint8_t* scratch, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override;
   virtual void encode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override;
 };
 
@@ -0,0 +1,363 @@
+// Benchmarks of the encoding / decoding hot paths, for every registered variant:
+// encodes/sec, decodes/sec and identify_param latency, plus the ns/byte of the common primitives.
+// Also compares the whitening by the cached keystreams to the bitwise LFSR they replace,
+// gives the per call latency of the FanLamp v3 signature, the cost of rejecting a packet compared to decoding it,
+// the cost of the diagnostics formatting avoided when the log level filters them, and the RAM used by the encoders.
+// Usage: bench_encoders [--quick]
+
+#include "host_test.h"
+
+#include <cstring>
+#include <random>
+#include <mbedtls/aes.h>
+#include <string>
+
+using namespace esphome::ble_adv_handler;
+
+// Access to the protected primitives of BleAdvEncoder
+class PrimitivesEncoder: public BleAdvEncoder {
+public:
+  PrimitivesEncoder(): BleAdvEncoder("bench", "primitives") {}
+  std::string to_str(const BleAdvEncCmd & enc_cmd) const override { return ""; }
+  using BleAdvEncoder::whiten;
+  using BleAdvEncoder::reverse_all;
+  using BleAdvEncoder::apply_whiten_key;
+
+  void set_whiten_key(size_t len, const std::vector< std::pair< size_t, uint8_t > > & passes) {
+    this->len_ = len;
+    this->reset_whiten_key();
+    for (auto & pass : passes) this->add_whiten_key(len - pass.first, pass.second);
+  }
+
+protected:
+  bool decode(const uint8_t* buf, uint8_t* scratch, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override { return false; }
+  void encode(uint8_t* buf, BleAdvEncCmd & enc_cmd, ControllerParam_t & cont) const override {}
+};
+
+struct Sample {
+  BleAdvEncCmd enc_cmd_;
+  ControllerParam_t cont_;
+  BleAdvParam param_;
+};
+
+static size_t nb_iterations = 200000;
+
+static void bench_primitives() {
+  PrimitivesEncoder enc;
+  uint8_t buf[MAX_PACKET_LEN];
+  for (size_t i = 0; i < sizeof(buf); ++i) buf[i] = i * 37;
+  const size_t len = sizeof(buf);
+
+  printf("\n%-12s %10s\n", "primitive", "ns/byte");
+  double whiten = host::time_ns(nb_iterations, [&](size_t i) { enc.whiten(buf, len, 0x37); host::keep(buf); });
+  printf("%-12s %10.2f\n", "whiten", whiten / len);
+  double reverse = host::time_ns(nb_iterations, [&](size_t i) { enc.reverse_all(buf, len); host::keep(buf); });
+  printf("%-12s %10.2f\n", "reverse_all", reverse / len);
+  double crc_le = host::time_ns(nb_iterations, [&](size_t i) { host::keep(crc16_le(buf, len, i)); });
+  printf("%-12s %10.2f\n", "crc16_le", crc_le / len);
+  double crc_be = host::time_ns(nb_iterations, [&](size_t i) { host::keep(crc16_be(buf, len, i)); });
+  printf("%-12s %10.2f\n", "crc16_be", crc_be / len);
+}
+
+// Whitening passes of the encoders using a fixed seed: length reduction and seed, as in their constructors
+static std::vector< std::pair< size_t, uint8_t > > whiten_passes(const BleAdvEncoder * encoder) {
+  if (dynamic_cast< const ZhijiaEncoderV0 * >(encoder) != nullptr) return {{0, 0x37}, {0, 0x7F}};
+  if (dynamic_cast< const ZhijiaEncoderV2 * >(encoder) != nullptr) return {{0, 0x6F}, {2, 0xD3}};
+  if (dynamic_cast< const ZhijiaEncoderV1 * >(encoder) != nullptr) return {{0, 0x37}};
+  if (dynamic_cast< const FanLampEncoderV1 * >(encoder) != nullptr) return {{0, 0x6F}};
+  return {};
+}
+
+// Whitening of one packet, by the bitwise LFSR run on each encode and on each candidate decode before
+// the keystreams were cached, and by the cached keystream. The identify_param line sums all the
+// whitening encoders, each of them de-whitening a candidate packet.
+static void bench_whitening(BleAdvHandler & handler) {
+  printf("\n%-22s %6s %10s %14s %8s\n", "whitening", "bytes", "lfsr ns", "keystream ns", "speedup");
+  double total_lfsr = 0;
+  double total_key = 0;
+  for (auto * encoder : host::get_host_encoders(handler)) {
+    auto passes = whiten_passes(encoder);
+    if (passes.empty()) continue;
+    size_t len = encoder->get_data_len() - encoder->get_header().size();
+    PrimitivesEncoder enc;
+    enc.set_whiten_key(len, passes);
+    uint8_t buf[MAX_PACKET_LEN];
+    for (size_t i = 0; i < sizeof(buf); ++i) buf[i] = i * 37;
+
+    double lfsr = host::time_ns(nb_iterations, [&](size_t i) {
+      for (auto & pass : passes) enc.whiten(buf, len - pass.first, pass.second);
+      host::keep(buf);
+    });
+    double key = host::time_ns(nb_iterations, [&](size_t i) { enc.apply_whiten_key(buf); host::keep(buf); });
+    printf("%-22s %6zu %10.1f %14.1f %7.1fx\n", encoder->get_id().c_str(), len, lfsr, key, lfsr / key);
+    total_lfsr += lfsr;
+    total_key += key;
+  }
+  printf("%-22s %6s %10.1f %14.1f %7.1fx\n", "identify_param", "", total_lfsr, total_key, total_lfsr / total_key);
+}
+
+static BleAdvEncoder * find_encoder(BleAdvHandler & handler, const std::string & id) {
+  for (auto * encoder : host::get_host_encoders(handler)) {
+    if (encoder->get_id() == id) return encoder;
+  }
+  return nullptr;
+}
+
+// FanLamp v3 signature, as done before the AES context was kept: init, key expansion, one block, free
+static uint16_t reference_sign(const uint8_t* buf, uint8_t tx_count, uint16_t seed) {
+  uint8_t sigkey[16] = {0, 0, 0, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16};
+  sigkey[0] = seed & 0xff;
+  sigkey[1] = (seed >> 8) & 0xff;
+  sigkey[2] = tx_count;
+  mbedtls_aes_context aes_ctx;
+  mbedtls_aes_init(&aes_ctx);
+  mbedtls_aes_setkey_enc(&aes_ctx, sigkey, sizeof(sigkey)*8);
+  uint8_t aes_out[16];
+  mbedtls_aes_crypt_ecb(&aes_ctx, MBEDTLS_AES_ENCRYPT, buf, aes_out);
+  mbedtls_aes_free(&aes_ctx);
+  uint16_t sign = 0;
+  std::memcpy(&sign, aes_out, sizeof(sign));
+  return sign;
+}
+
+// The signature latency is the difference between the v3 encoding, signed, and the v2 encoding, identical but not signed.
+// With the same seed and tx count the key is kept, as when a packet is re encoded or checked by several decoders,
+// else the key is reloaded, as for each new command.
+static void bench_signing(BleAdvHandler & handler) {
+  BleAdvEncoder * v2 = find_encoder(handler, "fanlamp_pro - v2");
+  BleAdvEncoder * v3 = find_encoder(handler, "fanlamp_pro - v3");
+  if ((v2 == nullptr) || (v3 == nullptr)) return;
+  BleAdvGenCmd gen_cmd(CommandType::LIGHT_ON);
+  BleAdvEncCmd enc_cmd;
+  v3->translate_g2e(enc_cmd, gen_cmd);
+  auto encode = [&](BleAdvEncoder * encoder, size_t i, bool same_key) {
+    ControllerParam_t cont = host::sample_controller(encoder, 1);
+    cont.seed_ = same_key ? 0x1234 : (1 + i % 0xFFF0);
+    BleAdvEncCmd cmd = enc_cmd;
+    BleAdvParam param;
+    encoder->encode(param, cmd, cont);
+    host::keep(param);
+  };
+  double v2_ns = host::time_ns(nb_iterations, [&](size_t i) { encode(v2, i, true); });
+  double v3_same_ns = host::time_ns(nb_iterations, [&](size_t i) { encode(v3, i, true); });
+  double v3_new_ns = host::time_ns(nb_iterations, [&](size_t i) { encode(v3, i, false); });
+  uint8_t buf[16] = {0};
+  double reference_ns = host::time_ns(nb_iterations, [&](size_t i) { host::keep(reference_sign(buf, i, i)); });
+
+  printf("\n%-36s %10s\n", "fanlamp v3 signature", "ns/call");
+  printf("%-36s %10.1f\n", "v2 encode, not signed", v2_ns);
+  printf("%-36s %10.1f\n", "v3 encode, same key", v3_same_ns);
+  printf("%-36s %10.1f\n", "v3 encode, new key", v3_new_ns);
+  printf("%-36s %10.1f\n", "sign, same key", v3_same_ns - v2_ns);
+  printf("%-36s %10.1f\n", "sign, new key", v3_new_ns - v2_ns);
+  printf("%-36s %10.1f\n", "reference init/setkey/ecb/free", reference_ns);
+}
+
+// one packet per supported command
+static std::vector< Sample > make_samples(BleAdvEncoder * encoder) {
+  auto cmds = host::sample_commands();
+  std::vector< Sample > samples;
+  for (size_t i = 0; i < cmds.size(); ++i) {
+    Sample sample;
+    if (!encoder->translate_g2e(sample.enc_cmd_, cmds[i])) continue;
+    sample.cont_ = host::sample_controller(encoder, i + 1);
+    BleAdvEncCmd enc_cmd = sample.enc_cmd_;
+    ControllerParam_t cont = sample.cont_;
+    encoder->encode(sample.param_, enc_cmd, cont);
+    samples.push_back(std::move(sample));
+  }
+  return samples;
+}
+
+// Mean decoding time of a set of packets
+static double time_decode(BleAdvEncoder * encoder, const std::vector< BleAdvParam > & params) {
+  return host::time_ns(nb_iterations, [&](size_t i) {
+    BleAdvEncCmd enc_cmd;
+    ControllerParam_t cont;
+    host::keep(encoder->decode(params[i % params.size()], enc_cmd, cont));
+  });
+}
+
+static size_t count_decoded(BleAdvEncoder * encoder, const std::vector< BleAdvParam > & params) {
+  size_t nb_decoded = 0;
+  for (auto & param : params) {
+    BleAdvEncCmd enc_cmd;
+    ControllerParam_t cont;
+    nb_decoded += encoder->decode(param, enc_cmd, cont);
+  }
+  return nb_decoded;
+}
+
+// Cost of rejecting a packet compared to decoding it, per variant:
+// - packets of the other variants, mostly discarded on their length or header
+// - random data behind the header of the variant and with its length, discarded by the structural prechecks
+//   or else by the full decoding, this being the worst case
+// The last column is the number of packets of both sets that were not rejected.
+static void bench_rejects(BleAdvHandler & handler) {
+  // raw packets of each variant, BleAdvParam being move only
+  auto encoders = host::get_host_encoders(handler);
+  std::vector< std::vector< std::vector< uint8_t > > > packets;
+  for (auto * encoder : encoders) {
+    packets.emplace_back();
+    for (auto & sample : make_samples(encoder)) {
+      packets.back().emplace_back(sample.param_.get_full_buf(), sample.param_.get_full_buf() + sample.param_.get_full_len());
+    }
+  }
+  auto add_param = [](std::vector< BleAdvParam > & params, const std::vector< uint8_t > & raw) {
+    params.emplace_back();
+    params.back().from_raw(raw.data(), raw.size());
+  };
+
+  std::mt19937 rng(7);
+  printf("\n%-22s %10s %12s %12s %10s\n", "reject", "decode ns", "others ns", "random ns", "accepted");
+  for (size_t e = 0; e < encoders.size(); ++e) {
+    BleAdvEncoder * encoder = encoders[e];
+    std::vector< BleAdvParam > own;
+    for (auto & raw : packets[e]) add_param(own, raw);
+    std::vector< BleAdvParam > others;
+    for (size_t o = 0; o < encoders.size(); ++o) {
+      if (o == e) continue;
+      for (auto & raw : packets[o]) add_param(others, raw);
+    }
+    std::vector< BleAdvParam > randoms;
+    for (size_t i = 0; i < 64; ++i) {
+      add_param(randoms, packets[e][i % packets[e].size()]);
+      BleAdvParam & param = randoms.back();
+      uint8_t * data = param.get_data_buf();
+      for (size_t j = encoder->get_header().size(); j < param.get_data_len(); ++j) data[j] = rng();
+    }
+
+    double decode = time_decode(encoder, own);
+    double reject_others = time_decode(encoder, others);
+    double reject_randoms = time_decode(encoder, randoms);
+    // packets of the other variants sharing the same format are accepted
+    printf("%-22s %10.1f %12.1f %12.1f %10zu\n", encoder->get_id().c_str(), decode, reject_others, reject_randoms,
+           count_decoded(encoder, others) + count_decoded(encoder, randoms));
+  }
+}
+
+static void bench_variants(BleAdvHandler & handler) {
+  printf("\n%-22s %8s %12s %12s %14s\n", "variant", "packets", "encodes/s", "decodes/s", "identify ns");
+  for (auto * encoder : host::get_host_encoders(handler)) {
+    std::vector< Sample > samples = make_samples(encoder);
+    size_t nb = samples.size();
+
+    double encode = host::time_ns(nb_iterations, [&](size_t i) {
+      Sample & sample = samples[i % nb];
+      BleAdvEncCmd enc_cmd = sample.enc_cmd_;
+      ControllerParam_t cont = sample.cont_;
+      BleAdvParam param;
+      encoder->encode(param, enc_cmd, cont);
+      host::keep(param);
+    });
+    size_t nb_decoded = 0;
+    double decode = host::time_ns(nb_iterations, [&](size_t i) {
+      BleAdvEncCmd enc_cmd;
+      ControllerParam_t cont;
+      nb_decoded += encoder->decode(samples[i % nb].param_, enc_cmd, cont);
+      host::keep(enc_cmd);
+    });
+    // all the registered encoders are candidates, as when a packet is captured
+    double identify = host::time_ns(nb_iterations / 4, [&](size_t i) {
+      host::keep(handler.identify_param(samples[i % nb].param_, true));
+    });
+    printf("%-22s %8zu %12.0f %12.0f %14.0f%s\n", encoder->get_id().c_str(), nb, 1e9 / encode, 1e9 / decode, identify,
+           (nb_decoded == nb_iterations) ? "" : "  DECODE FAILURES");
+  }
+}
+
+// Diagnostics on the enqueue and capture paths, the runtime log level filtering the DEBUG logs:
+// the formatting done eagerly before, per packet encoded and per candidate decoder, compared to the encoding
+// and identification with lazy formatting, and the cost of the log level check, with and without the per tag lookup
+static void bench_diagnostics(BleAdvHandler & handler) {
+  BleAdvEncoder * encoder = find_encoder(handler, "fanlamp_pro - v3");
+  if (encoder == nullptr) return;
+  std::vector< Sample > samples = make_samples(encoder);
+  size_t nb = samples.size();
+  const char * tag = encoder->get_id().c_str();
+
+  double check = host::time_ns(nb_iterations, [&](size_t i) { host::keep(log_enabled(ESPHOME_LOG_LEVEL_DEBUG)); });
+  double check_tag = host::time_ns(nb_iterations, [&](size_t i) {
+    host::keep(esphome::logger::global_logger->level_for(tag) < ESPHOME_LOG_LEVEL_DEBUG);
+  });
+  double encode = host::time_ns(nb_iterations, [&](size_t i) {
+    BleAdvEncCmd enc_cmd = samples[i % nb].enc_cmd_;
+    ControllerParam_t cont = samples[i % nb].cont_;
+    BleAdvParam param;
+    encoder->encode(param, enc_cmd, cont);
+    host::keep(param);
+  });
+  // command description in encode, hex dump of the packet when queued for air
+  double enqueue_fmt = host::time_ns(nb_iterations, [&](size_t i) {
+    Sample & sample = samples[i % nb];
+    host::keep(encoder->to_str(sample.enc_cmd_).size());
+    host::keep(esphome::format_hex_pretty(sample.param_.get_full_buf(), sample.param_.get_full_len()).size());
+  });
+  double identify = host::time_ns(nb_iterations / 4, [&](size_t i) {
+    host::keep(handler.identify_param(samples[i % nb].param_, true));
+  });
+  // hex dump built by each FanLamp candidate decoder before its first check, upper bound counting all of them
+  size_t nb_candidates = 0;
+  for (auto * enc : host::get_host_encoders(handler)) {
+    nb_candidates += (enc->get_encoding() != "zhijia") && (enc->get_encoding() != "zhiguang");
+  }
+  double capture_fmt = host::time_ns(nb_iterations / 4, [&](size_t i) {
+    Sample & sample = samples[i % nb];
+    for (size_t c = 0; c < nb_candidates; ++c) {
+      host::keep(esphome::format_hex_pretty(sample.param_.get_const_data_buf(), sample.param_.get_data_len()).size());
+    }
+  });
+
+  printf("\n%-36s %10s\n", "diagnostics, DEBUG filtered", "ns/call");
+  printf("%-36s %10.1f\n", "log_enabled, global level", check);
+  printf("%-36s %10.1f\n", "log_enabled, per tag level", check_tag);
+  printf("%-36s %10.1f\n", "enqueue: encode", encode);
+  printf("%-36s %10.1f\n", "enqueue: eager formatting", enqueue_fmt);
+  printf("%-36s %10.1f\n", "capture: identify_param", identify);
+  printf("%-36s %10.1f\n", "capture: eager formatting", capture_fmt);
+}
+
+// Static size of the encoder types and of the main structures, and heap used by the registration of the encoders
+static void bench_memory() {
+  printf("\n%-22s %10s\n", "memory", "bytes");
+  printf("%-22s %10zu\n", "FanLampEncoderV1", sizeof(FanLampEncoderV1));
+  printf("%-22s %10zu\n", "FanLampEncoderV2", sizeof(FanLampEncoderV2));
+  printf("%-22s %10zu\n", "ZhijiaEncoderV0", sizeof(ZhijiaEncoderV0));
+  printf("%-22s %10zu\n", "ZhijiaEncoderV1", sizeof(ZhijiaEncoderV1));
+  printf("%-22s %10zu\n", "ZhijiaEncoderV2", sizeof(ZhijiaEncoderV2));
+  printf("%-22s %10zu\n", "BleAdvParam", sizeof(BleAdvParam));
+  printf("%-22s %10zu\n", "BleAdvProcess", sizeof(BleAdvProcess));
+  printf("%-22s %10zu\n", "BleAdvHandler", sizeof(BleAdvHandler));
+
+  // the encoders are never freed, as on the device
+  size_t nb_allocs = host::get_nb_allocs();
+  size_t alloc_bytes = host::get_alloc_bytes();
+  BleAdvHandler * handler = new BleAdvHandler();
+  add_host_encoders(*handler);
+  nb_allocs = host::get_nb_allocs() - nb_allocs;
+  alloc_bytes = host::get_alloc_bytes() - alloc_bytes - sizeof(BleAdvHandler);
+  size_t nb_encoders = host::get_host_encoders(*handler).size();
+  printf("%-22s %10zu  (%zu encoders, %zu allocations, %zu bytes per encoder)\n", "encoders heap", alloc_bytes,
+         nb_encoders, nb_allocs - 1, alloc_bytes / nb_encoders);
+}
+
+int main(int argc, char ** argv) {
+  if ((argc > 1) && (strcmp(argv[1], "--quick") == 0)) {
+    nb_iterations = 2000;
+  }
+  host::reset();
+  // identify_param logs its results at INFO level
+  host::set_log_level(ESPHOME_LOG_LEVEL_WARN);
+  BleAdvHandler handler;
+  add_host_encoders(handler);
+
+  printf("Iterations: %zu\n", nb_iterations);
+  bench_primitives();
+  bench_variants(handler);
+  bench_whitening(handler);
+  bench_signing(handler);
+  bench_rejects(handler);
+  bench_diagnostics(handler);
+  bench_memory();
+  return 0;
+}
@@ -0,0 +1,155 @@
+// Fuzzing of BleAdvParam::from_raw and of the decoding by every encoder, checking for each input that:
+// - the decoding does not alter the packet, and gives the same result with or without a shared decoding context
+// - a decoded packet is re-encoded from the decoded command into a packet decoded to the same command
+// With clang and BLE_ADV_FUZZER=ON, this is a libFuzzer target, to be seeded with the golden packets.
+// Else the standalone driver feeds random buffers and mutated golden packets, then times the decode of each encoder.
+// Usage: fuzz_decode <golden corpus> [nb inputs]
+
+#include "host_test.h"
+
+#include <cstring>
+#include <fstream>
+#include <random>
+
+using namespace esphome::ble_adv_handler;
+
+// the buffer received from the scanner holds up to 62 bytes, advertising and scan response data
+static constexpr size_t MAX_INPUT_LEN = 62;
+
+static BleAdvHandler * handler = nullptr;
+static std::vector< BleAdvEncoder * > encoders;
+
+static void init() {
+  if (handler != nullptr) return;
+  host::reset();
+  // identify_param logs an error for each non canonical packet decoded
+  host::set_log_level(ESPHOME_LOG_LEVEL_NONE);
+  handler = new BleAdvHandler();
+  esphome::add_host_encoders(*handler);
+  encoders = host::get_host_encoders(*handler);
+}
+
+static bool same_result(const BleAdvEncCmd & cmd1, const ControllerParam_t & cont1, const BleAdvEncCmd & cmd2, const ControllerParam_t & cont2) {
+  return (cmd1.cmd == cmd2.cmd) && (cmd1.param1 == cmd2.param1) && std::equal(cmd1.args, cmd1.args + 3, cmd2.args)
+      && (cont1.id_ == cont2.id_) && (cont1.tx_count_ == cont2.tx_count_) && (cont1.index_ == cont2.index_) && (cont1.seed_ == cont2.seed_);
+}
+
+static void check_input(const uint8_t * data, size_t size) {
+  BleAdvParam param;
+  param.from_raw(data, size);
+  HOST_CHECK(param.get_full_len() <= MAX_PACKET_LEN, "length %d", param.get_full_len());
+  if (!param.has_data()) return;
+
+  uint8_t raw[MAX_PACKET_LEN];
+  std::copy(param.get_full_buf(), param.get_full_buf() + MAX_PACKET_LEN, raw);
+  BleAdvDecodeContext ctx(param);
+  for (auto * encoder : encoders) {
+    BleAdvEncCmd cmd;
+    ControllerParam_t cont;
+    bool decoded = encoder->decode(param, cmd, cont);
+    BleAdvEncCmd ctx_cmd;
+    ControllerParam_t ctx_cont;
+    bool ctx_decoded = encoder->decode(ctx, ctx_cmd, ctx_cont);
+    HOST_CHECK(decoded == ctx_decoded, "%s: decoded %d with context, %d without", encoder->get_id().c_str(), ctx_decoded, decoded);
+    HOST_CHECK(std::equal(raw, raw + MAX_PACKET_LEN, param.get_full_buf()), "%s: packet altered", encoder->get_id().c_str());
+    if (!decoded || !ctx_decoded) continue;
+    HOST_CHECK(same_result(cmd, cont, ctx_cmd, ctx_cont), "%s: other result with context", encoder->get_id().c_str());
+
+    BleAdvParam re_param;
+    BleAdvEncCmd re_cmd = cmd;
+    ControllerParam_t re_cont = cont;
+    encoder->encode(re_param, re_cmd, re_cont);
+    BleAdvEncCmd dec_cmd;
+    ControllerParam_t dec_cont;
+    HOST_CHECK(encoder->decode(re_param, dec_cmd, dec_cont), "%s: re-encoded packet not decoded - %s", encoder->get_id().c_str(),
+               host::to_hex(raw, param.get_full_len()).c_str());
+    HOST_CHECK(same_result(re_cmd, re_cont, dec_cmd, dec_cont), "%s: re-encoded packet decoded differently - %s", encoder->get_id().c_str(),
+               host::to_hex(raw, param.get_full_len()).c_str());
+  }
+  handler->identify_param(param, true);
+}
+
+#ifdef BLE_ADV_FUZZER
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+  init();
+  check_input(data, std::min(size, MAX_INPUT_LEN));
+  if (host::nb_failures > 0) abort();
+  return 0;
+}
+#else
+static std::vector< std::vector< uint8_t > > load_golden(const char * corpus) {
+  std::vector< std::vector< uint8_t > > packets;
+  std::ifstream file(corpus);
+  std::string line;
+  while (std::getline(file, line)) {
+    BleAdvParam param = host::param_from_hex(line.substr(line.rfind(';') + 1));
+    packets.emplace_back(param.get_full_buf(), param.get_full_buf() + param.get_full_len());
+  }
+  return packets;
+}
+
+// random buffers, random data behind a valid structure, golden packets with bits flipped or with a random length
+static std::vector< std::vector< uint8_t > > gen_inputs(const std::vector< std::vector< uint8_t > > & golden, size_t nb_inputs) {
+  std::mt19937 rng(1234);
+  std::vector< std::vector< uint8_t > > inputs;
+  for (size_t i = 0; i < nb_inputs; ++i) {
+    std::vector< uint8_t > input(rng() % (MAX_INPUT_LEN + 1));
+    for (auto & byte : input) byte = rng();
+    const std::vector< uint8_t > & ref = golden[rng() % golden.size()];
+    switch (i % 4) {
+      case 1:
+        // valid flags and data headers, random content
+        if (input.size() > 5) {
+          std::copy(ref.begin(), ref.begin() + 5, input.begin());
+        }
+        break;
+      case 2:
+        input = ref;
+        for (size_t nb_flips = 1 + rng() % 3; nb_flips > 0; --nb_flips) {
+          input[rng() % input.size()] ^= 1 << (rng() % 8);
+        }
+        break;
+      case 3:
+        input = ref;
+        input.resize(rng() % (MAX_INPUT_LEN + 1), (uint8_t) rng());
+        break;
+      default:
+        break;
+    }
+    inputs.push_back(std::move(input));
+  }
+  return inputs;
+}
+
+int main(int argc, char ** argv) {
+  init();
+  auto golden = load_golden((argc > 1) ? argv[1] : "golden/packets.txt");
+  HOST_CHECK(!golden.empty(), "no golden packets");
+  if (golden.empty()) return host::test_result();
+  size_t nb_inputs = (argc > 2) ? std::stoul(argv[2]) : 100000;
+  auto inputs = gen_inputs(golden, nb_inputs);
+  for (auto & input : inputs) {
+    check_input(input.data(), input.size());
+  }
+  printf("%zu inputs checked\n", inputs.size());
+
+  // decoding time per encoder over all the inputs, most of them being rejected
+  std::vector< BleAdvParam > params;
+  for (auto & input : inputs) {
+    BleAdvParam param;
+    param.from_raw(input.data(), input.size());
+    if (param.has_data()) params.push_back(std::move(param));
+  }
+  printf("\n%-22s %10s %12s\n", "variant", "decoded", "ns/decode");
+  for (auto * encoder : encoders) {
+    size_t nb_decoded = 0;
+    double ns = host::time_ns(params.size(), [&](size_t i) {
+      BleAdvEncCmd cmd;
+      ControllerParam_t cont;
+      nb_decoded += encoder->decode(params[i], cmd, cont);
+    });
+    printf("%-22s %10zu %12.1f\n", encoder->get_id().c_str(), nb_decoded, ns);
+  }
+  return host::test_result();
+}
+#endif
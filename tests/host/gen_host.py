@@ -0,0 +1,143 @@
+"""Generate the C++ part of ble_adv_handler normally produced by the ESPHome codegen, for the host build.
+
+Usage: gen_host.py <components dir> <output header>
+
+The component definitions are loaded from ble_adv_handler/__init__.py with a stand-in of the esphome package,
+so that the host build always uses the same translators and encoder variants as the devices.
+"""
+
+import importlib.util
+import os
+import re
+import sys
+import types
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "pymock"))
+
+import esphome.codegen as cg  # noqa: E402
+
+
+def load_component(components_dir, name):
+    comp_dir = os.path.join(components_dir, name)
+    pkg = types.ModuleType(name)
+    pkg.__path__ = [comp_dir]
+    sys.modules[name] = pkg
+    spec = importlib.util.spec_from_file_location(f"{name}.__init__", os.path.join(comp_dir, "__init__.py"))
+    module = importlib.util.module_from_spec(spec)
+    module.__package__ = name
+    spec.loader.exec_module(module)
+    return module
+
+
+def cpp_arg(arg):
+    if isinstance(arg, bool):
+        return "true" if arg else "false"
+    if isinstance(arg, list):
+        return "{" + ", ".join([cpp_arg(x) for x in arg]) + "}"
+    if isinstance(arg, str):
+        return f'"{arg}"'
+    return str(arg)
+
+
+def gen_encoders(handler):
+    # same registration as to_code, with the translators defined once
+    code = "inline void add_host_encoders(ble_adv_handler::BleAdvHandler & handler) {"
+    for encoding, params in handler.BLE_ADV_ENCODERS.items():
+        for variant, param_variant in params["variants"].items():
+            if "class" not in param_variant:
+                continue
+            args = ", ".join([cpp_arg(x) for x in [encoding, variant, *param_variant["args"]]])
+            translator = handler.TranslatorGenerator.get_translator_instance(param_variant["class"])
+            code += "\n  {"
+            code += f"\n    auto * enc = new {param_variant['class']}({args});"
+            code += f"\n    enc->set_ble_param({', '.join([cpp_arg(x) for x in param_variant['ble_param']])});"
+            code += f"\n    enc->set_header({cpp_arg(param_variant['header'])});"
+            code += f"\n    enc->set_translator({translator});"
+            code += "\n    handler.add_encoder(enc);"
+            code += "\n  }"
+    code += "\n}"
+    ids = [f'"{encoding} - {variant}"' for encoding, params in handler.BLE_ADV_ENCODERS.items()
+           for variant, param_variant in params["variants"].items() if "class" in param_variant]
+    code += f"\n\nstatic constexpr const char * HOST_ENCODER_IDS[] = {{ {', '.join(ids)} }};"
+    return code
+
+
+def gen_reference_translators(handler):
+    # translators as generated before the dispatch tables: a flat chain of independent ifs in the translators order,
+    # a later match overwriting the previous ones, only used to check the dispatch tables are equivalent
+    gen = handler.TranslatorGenerator
+    code = ""
+    pairs = []
+    g_values = set()
+    e_values = set()
+    for name, translators in gen.translators.items():
+        trans_class_name = name.split(":")[-1].replace("Encoder", "Translator")
+        ref_class_name = f"Ref{trans_class_name}"
+        code += f"class {ref_class_name} final: public {handler.CommandTranslator}\n{{"
+        code += "\npublic:"
+        code += f"\n  void g2e_cmd(const {handler.BleAdvGenCmd} & g, {handler.BleAdvEncCmd} & e) const override {{"
+        for conds in translators:
+            if_cond = " && ".join([f"(g.{attr} == {val})" for (attr, val) in conds["g"].items()])
+            code += f"\n    if ({if_cond}) {{ {gen.g2e_exec(conds)} }}"
+        code += "\n  }"
+        code += f"\n  void e2g_cmd(const {handler.BleAdvEncCmd} & e, {handler.BleAdvGenCmd} & g) const override {{"
+        for conds in translators:
+            if_cond = " && ".join([f"(e.{attr} == {val})" for (attr, val) in conds["e"].items()])
+            code += f"\n    if ({if_cond}) {{ {gen.e2g_exec(conds)} }}"
+        code += "\n  }"
+        code += "\n};\n\n"
+        pairs.append(f'{{ "{trans_class_name}", {gen.get_translator_instance(name)}, new {ref_class_name}() }}')
+        # values compared by the conditions, besides the command
+        g_values.update([str(val) for conds in translators for (attr, val) in conds["g"].items() if attr != "cmd"])
+        e_values.update([str(val) for conds in translators for (attr, val) in conds["e"].items() if attr != "cmd"])
+    code += "struct HostTranslatorPair {\n  const char * name_;\n"
+    code += f"  {handler.CommandTranslator} * translator_;\n  {handler.CommandTranslator} * reference_;\n}};"
+    code += f"\ninline const HostTranslatorPair HOST_TRANSLATORS[] = {{\n  {(',' + chr(10) + '  ').join(pairs)}\n}};"
+    code += f"\nstatic constexpr float HOST_TRANSLATOR_G_VALUES[] = {{ {', '.join(sorted(g_values))} }};"
+    code += f"\nstatic constexpr uint8_t HOST_TRANSLATOR_E_VALUES[] = {{ {', '.join(sorted(e_values))} }};"
+    return code
+
+
+def gen_raw_samples(components_dir):
+    # raw packets captured from real devices, given as comments of the variants in __init__.py
+    samples = []
+    encoding = variant = None
+    with open(os.path.join(components_dir, "ble_adv_handler", "__init__.py")) as init:
+        for line in init:
+            if m := re.match(r'^    "(\w+)" ?: ?\{', line):
+                encoding = m.group(1)
+            elif m := re.match(r'^            "(\w+)": ?\{', line):
+                variant = m.group(1)
+            elif m := re.match(r'^\s*# ((?:[0-9A-F]{2}\.)+[0-9A-F]{2}) \(\d+\)', line):
+                samples.append(f'{{ "{encoding} - {variant}", "{m.group(1)}" }}')
+    code = "struct HostRawSample { const char * id_; const char * raw_; };"
+    code += f"\nstatic constexpr HostRawSample HOST_RAW_SAMPLES[] = {{\n  {(',' + chr(10) + '  ').join(samples)}\n}};"
+    return code
+
+
+def main():
+    components_dir, output = sys.argv[1], sys.argv[2]
+    handler = load_component(components_dir, "ble_adv_handler")
+    encoders = gen_encoders(handler)
+    reference_translators = gen_reference_translators(handler)
+    raw_samples = gen_raw_samples(components_dir)
+    with open(output, "w") as out:
+        out.write("// Generated by gen_host.py from ble_adv_handler/__init__.py, do not edit\n")
+        out.write("#pragma once\n\n")
+        out.write('#include "esphome/components/ble_adv_handler/ble_adv_handler.h"\n')
+        out.write('#include "esphome/components/ble_adv_handler/fanlamp_pro.h"\n')
+        out.write('#include "esphome/components/ble_adv_handler/zhijia.h"\n\n')
+        out.write("namespace esphome {\n\n")
+        for statement in cg.OUT:
+            # the translator instances are local variables of the generated setup, global ones here
+            if statement.startswith("esphome::") and " = new " in statement:
+                statement = "inline " + statement
+            out.write(f"{statement};\n\n")
+        out.write(encoders + "\n\n")
+        out.write(reference_translators + "\n\n")
+        out.write(raw_samples + "\n\n")
+        out.write("} // namespace esphome\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,349 @@
+#include "host_sim.h"
+
+#include "esphome/core/hal.h"
+#include "esphome/core/helpers.h"
+#include "esphome/core/log.h"
+#include "esphome/core/preferences.h"
+#include "esphome/core/application.h"
+#include "esphome/components/logger/logger.h"
+#include "esphome/components/esp32_ble/ble.h"
+#include <esp_gap_ble_api.h>
+#include <esp_timer.h>
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace esphome {
+
+ESPPreferences * global_preferences = nullptr;
+Application App;
+uint32_t Mutex::nb_locks = 0;
+
+uint32_t millis() { return host::now_us() / 1000; }
+uint32_t micros() { return host::now_us(); }
+
+uint16_t crc16(const uint8_t * data, uint16_t len, uint16_t crc, uint16_t reverse_poly, bool refin, bool refout) {
+  if (refin) crc ^= 0xffff;
+  while (len--) {
+    crc ^= *data++;
+    for (uint8_t i = 0; i < 8; i++) {
+      crc = (crc & 1) ? ((crc >> 1) ^ reverse_poly) : (crc >> 1);
+    }
+  }
+  return refout ? (crc ^ 0xffff) : crc;
+}
+
+uint16_t crc16be(const uint8_t * data, uint16_t len, uint16_t crc, uint16_t poly, bool refin, bool refout) {
+  if (refin) crc ^= 0xffff;
+  while (len--) {
+    crc ^= ((uint16_t) *data++) << 8;
+    for (uint8_t i = 0; i < 8; i++) {
+      crc = (crc & 0x8000) ? ((crc << 1) ^ poly) : (crc << 1);
+    }
+  }
+  return refout ? (crc ^ 0xffff) : crc;
+}
+
+std::string format_hex_pretty(const uint8_t * data, size_t length) {
+  if (length == 0) return "";
+  std::string ret;
+  char hex[4];
+  for (size_t i = 0; i < length; ++i) {
+    snprintf(hex, sizeof(hex), (i == 0) ? "%02X" : ".%02X", data[i]);
+    ret += hex;
+  }
+  return ret + " (" + std::to_string(length) + ")";
+}
+
+uint32_t fnv1_hash(const std::string & str) {
+  uint32_t hash = 2166136261UL;
+  for (char c : str) {
+    hash *= 16777619UL;
+    hash ^= c;
+  }
+  return hash;
+}
+
+void esp_log_printf_(int level, const char * tag, int line, const char * format, ...) {
+  if ((logger::global_logger != nullptr) && (level > logger::global_logger->level_for(tag))) return;
+  static const char * LETTERS[] = {"", "E", "W", "I", "C", "D", "V", "VV"};
+  printf("[%s][%s:%d]: ", LETTERS[level], tag, line);
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  printf("\n");
+}
+
+namespace logger {
+Logger * global_logger = nullptr;
+}
+
+namespace esp32_ble {
+static ESP32BLE ble;
+ESP32BLE * global_ble = &ble;
+}
+
+} // namespace esphome
+
+struct esp_timer {
+  esp_timer_cb_t callback_;
+  void * arg_;
+  int64_t deadline_;
+};
+
+namespace host {
+
+static int64_t sim_now = 0;
+
+// never released, the tests setting up a new handler per case
+static constexpr size_t MAX_TIMERS = 64;
+static esp_timer timers[MAX_TIMERS];
+static size_t nb_timers = 0;
+
+GapConfig gap_config;
+static uint32_t nb_gap_requests = 0;
+
+// GAP events waiting for their delivery time, with the on air change they carry
+struct GapEvent {
+  int64_t time_;
+  esp_gap_ble_cb_event_t event_;
+  esp_ble_gap_cb_param_t param_;
+  uint8_t instance_;
+  uint8_t len_;
+  uint8_t data_[31];
+};
+static constexpr size_t MAX_EVENTS = 32;
+static GapEvent events[MAX_EVENTS];
+static size_t nb_events = 0;
+
+// advertising instances: data set, running state and index of their on air record if any
+struct Instance {
+  bool running_;
+  uint8_t len_;
+  uint8_t data_[31];
+  size_t on_air_;
+};
+static constexpr size_t MAX_INSTANCES = 10;
+static Instance instances[MAX_INSTANCES];
+
+static constexpr size_t MAX_ON_AIR = 8192;
+static OnAir on_air[MAX_ON_AIR];
+static size_t nb_on_air = 0;
+
+static esphome::logger::Logger logger;
+
+static size_t nb_allocs = 0;
+static size_t alloc_bytes = 0;
+
+int64_t now_us() { return sim_now; }
+void set_now_us(int64_t now) { sim_now = now; }
+uint32_t get_nb_gap_requests() { return nb_gap_requests; }
+size_t get_nb_on_air() { return nb_on_air; }
+const OnAir & get_on_air(size_t index) { return on_air[index]; }
+
+void reset() {
+  sim_now = 0;
+  nb_events = 0;
+  nb_on_air = 0;
+  nb_gap_requests = 0;
+  gap_config = GapConfig();
+  for (size_t i = 0; i < nb_timers; ++i) {
+    timers[i].deadline_ = -1;
+  }
+  for (auto & instance : instances) {
+    instance = Instance{false, 0, {0}, MAX_ON_AIR};
+  }
+}
+
+void set_log_level(int level) {
+  logger.set_log_level(level);
+  esphome::logger::global_logger = &logger;
+}
+
+size_t get_nb_allocs() { return nb_allocs; }
+size_t get_alloc_bytes() { return alloc_bytes; }
+
+static void close_on_air(Instance & instance) {
+  if (instance.on_air_ < nb_on_air) {
+    on_air[instance.on_air_].end_us_ = sim_now;
+  }
+  instance.on_air_ = MAX_ON_AIR;
+}
+
+static void open_on_air(uint8_t index, Instance & instance) {
+  close_on_air(instance);
+  if (nb_on_air == MAX_ON_AIR) return;
+  OnAir & rec = on_air[nb_on_air];
+  rec.instance_ = index;
+  rec.len_ = instance.len_;
+  std::copy(instance.data_, instance.data_ + instance.len_, rec.data_);
+  rec.start_us_ = sim_now;
+  rec.end_us_ = -1;
+  instance.on_air_ = nb_on_air++;
+}
+
+static esp_err_t post_event(esp_gap_ble_cb_event_t event, uint8_t instance, const uint8_t * data = nullptr, uint8_t len = 0) {
+  nb_gap_requests++;
+  if (gap_config.lose_events) return ESP_OK;
+  if (nb_events == MAX_EVENTS) return ESP_FAIL;
+  GapEvent & ev = events[nb_events++];
+  ev.time_ = sim_now + gap_config.latency_us;
+  ev.event_ = event;
+  ev.param_ = {};
+  // the status is the first field of all the event params
+  ev.param_.adv_data_raw_cmpl.status = gap_config.fail_requests ? ESP_BT_STATUS_FAIL : ESP_BT_STATUS_SUCCESS;
+  ev.param_.ext_adv_data_set.instance = instance;
+  ev.instance_ = instance;
+  ev.len_ = (len > 31) ? 31 : len;
+  if (data != nullptr) {
+    std::copy(data, data + ev.len_, ev.data_);
+  }
+  return ESP_OK;
+}
+
+// Apply the effect of the request on the instance, then notify the stack user
+static void deliver(const GapEvent & ev) {
+  Instance & instance = instances[ev.instance_];
+  bool success = (ev.param_.adv_data_raw_cmpl.status == ESP_BT_STATUS_SUCCESS);
+  if (success) {
+    switch (ev.event_) {
+      case ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT:
+      case ESP_GAP_BLE_EXT_ADV_DATA_SET_COMPLETE_EVT:
+        instance.len_ = ev.len_;
+        std::copy(ev.data_, ev.data_ + ev.len_, instance.data_);
+        if (instance.running_) {
+          open_on_air(ev.instance_, instance);
+        }
+        break;
+      case ESP_GAP_BLE_ADV_START_COMPLETE_EVT:
+      case ESP_GAP_BLE_EXT_ADV_START_COMPLETE_EVT:
+        instance.running_ = true;
+        open_on_air(ev.instance_, instance);
+        break;
+      case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:
+      case ESP_GAP_BLE_EXT_ADV_STOP_COMPLETE_EVT:
+        instance.running_ = false;
+        close_on_air(instance);
+        break;
+      default:
+        break;
+    }
+  }
+  esphome::esp32_ble::GAPEventHandler * handler = esphome::esp32_ble::global_ble->get_gap_event_handler();
+  if (handler != nullptr) {
+    esp_ble_gap_cb_param_t param = ev.param_;
+    handler->gap_event_handler(ev.event_, &param);
+  }
+}
+
+void run_for(int64_t duration_us, LoopFn loop, void * arg, int64_t loop_period_us) {
+  int64_t end = sim_now + duration_us;
+  int64_t next_loop = sim_now;
+  while (true) {
+    // earliest of: GAP event, timer, loop
+    int64_t next = end + 1;
+    size_t event = MAX_EVENTS;
+    for (size_t i = 0; i < nb_events; ++i) {
+      if (events[i].time_ < next) {
+        next = events[i].time_;
+        event = i;
+      }
+    }
+    esp_timer * timer = nullptr;
+    for (size_t i = 0; i < nb_timers; ++i) {
+      if ((timers[i].deadline_ >= 0) && (timers[i].deadline_ < next)) {
+        next = timers[i].deadline_;
+        timer = &timers[i];
+        event = MAX_EVENTS;
+      }
+    }
+    bool run_loop = (loop != nullptr) && (next_loop < next) && (next_loop <= end);
+    if (run_loop) {
+      next = next_loop;
+    } else if (next > end) {
+      break;
+    }
+    sim_now = std::max(sim_now, next);
+    if (run_loop) {
+      next_loop += loop_period_us;
+      loop(arg);
+    } else if (event < MAX_EVENTS) {
+      GapEvent ev = events[event];
+      std::copy(events + event + 1, events + nb_events, events + event);
+      nb_events--;
+      deliver(ev);
+    } else {
+      timer->deadline_ = -1;
+      timer->callback_(timer->arg_);
+    }
+  }
+  sim_now = end;
+}
+
+} // namespace host
+
+int esp_timer_create(const esp_timer_create_args_t * create_args, esp_timer_handle_t * out_handle) {
+  if (host::nb_timers == host::MAX_TIMERS) return ESP_FAIL;
+  esp_timer & timer = host::timers[host::nb_timers++];
+  timer = esp_timer{create_args->callback, create_args->arg, -1};
+  *out_handle = &timer;
+  return ESP_OK;
+}
+
+// as ESP-IDF, a running timer cannot be started again before being stopped
+int esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+  if (timer->deadline_ >= 0) return 0x103; // ESP_ERR_INVALID_STATE
+  timer->deadline_ = host::sim_now + timeout_us;
+  return ESP_OK;
+}
+
+int esp_timer_stop(esp_timer_handle_t timer) {
+  if (timer->deadline_ < 0) return 0x103; // ESP_ERR_INVALID_STATE
+  timer->deadline_ = -1;
+  return ESP_OK;
+}
+
+int64_t esp_timer_get_time() { return host::sim_now; }
+
+esp_err_t esp_ble_gap_config_adv_data_raw(uint8_t * raw_data, uint32_t raw_data_len) {
+  return host::post_event(ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT, 0, raw_data, raw_data_len);
+}
+
+esp_err_t esp_ble_gap_start_advertising(esp_ble_adv_params_t * adv_params) {
+  return host::post_event(ESP_GAP_BLE_ADV_START_COMPLETE_EVT, 0);
+}
+
+esp_err_t esp_ble_gap_stop_advertising(void) {
+  return host::post_event(ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT, 0);
+}
+
+esp_err_t esp_ble_gap_ext_adv_set_params(uint8_t instance, const esp_ble_gap_ext_adv_params_t * params) {
+  return host::post_event(ESP_GAP_BLE_EXT_ADV_SET_PARAMS_COMPLETE_EVT, instance);
+}
+
+esp_err_t esp_ble_gap_config_ext_adv_data_raw(uint8_t instance, uint16_t length, const uint8_t * data) {
+  return host::post_event(ESP_GAP_BLE_EXT_ADV_DATA_SET_COMPLETE_EVT, instance, data, length);
+}
+
+esp_err_t esp_ble_gap_ext_adv_start(uint8_t num_adv, const esp_ble_gap_ext_adv_t * ext_adv) {
+  return host::post_event(ESP_GAP_BLE_EXT_ADV_START_COMPLETE_EVT, ext_adv[0].instance);
+}
+
+esp_err_t esp_ble_gap_ext_adv_stop(uint8_t num_adv, const uint8_t * ext_adv_inst) {
+  return host::post_event(ESP_GAP_BLE_EXT_ADV_STOP_COMPLETE_EVT, ext_adv_inst[0]);
+}
+
+// Replacement of the global allocation functions, counting the allocations
+void * operator new(size_t size) {
+  ++host::nb_allocs;
+  host::alloc_bytes += size;
+  void * ptr = std::malloc((size == 0) ? 1 : size);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void * ptr) noexcept { std::free(ptr); }
+void operator delete(void * ptr, size_t) noexcept { std::free(ptr); }
@@ -0,0 +1,53 @@
+#pragma once
+
+// Simulated ESP32 environment of the host build: clock, esp_timer, GAP layer and logger.
+// The simulated time only moves forward through run_for, firing the timers and delivering the GAP events
+// in chronological order, so that the advertiser can be tested without any real delay.
+// Nothing here allocates once started, so that the allocation counting tests can run on top of it.
+
+#include <cstddef>
+#include <cstdint>
+
+namespace host {
+
+// Clock used by millis(), micros() and esp_timer_get_time()
+int64_t now_us();
+void set_now_us(int64_t now);
+
+// Move the simulated time forward, calling the loop function at the ESPHome main loop cadence
+using LoopFn = void (*)(void * arg);
+void run_for(int64_t duration_us, LoopFn loop = nullptr, void * arg = nullptr, int64_t loop_period_us = 16000);
+
+// Simulated GAP layer: each request completes after the latency, by the corresponding GAP event
+struct GapConfig {
+  int64_t latency_us{300};
+  // the requests are accepted but their completion events report a failure
+  bool fail_requests{false};
+  // the requests are accepted but their completion events are never sent
+  bool lose_events{false};
+};
+extern GapConfig gap_config;
+uint32_t get_nb_gap_requests();
+
+// Packets effectively on air, per advertising instance, the last one being still on air if end_us_ is negative
+struct OnAir {
+  uint8_t instance_;
+  uint8_t len_;
+  uint8_t data_[31];
+  int64_t start_us_;
+  int64_t end_us_;
+};
+size_t get_nb_on_air();
+const OnAir & get_on_air(size_t index);
+
+// Back to time 0, no timer running, no GAP request in progress, nothing on air
+void reset();
+
+// Logger configured with the given runtime level, instead of no logger at all
+void set_log_level(int level);
+
+// Heap allocations done since the start, counted by the replacement of the global operator new
+size_t get_nb_allocs();
+size_t get_alloc_bytes();
+
+} // namespace host
@@ -0,0 +1,106 @@
+#pragma once
+
+// Helpers shared by the host tests and benchmarks
+
+#include "host_components.h"
+#include "host_sim.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace host {
+
+using namespace esphome::ble_adv_handler;
+using esphome::add_host_encoders;
+
+// Failure reported with its location, the test going on to report all the failures at once
+inline int nb_failures = 0;
+#define HOST_CHECK(cond, ...) do { if (!(cond)) { \
+  host::nb_failures++; printf("%s:%d: CHECK failed: %s - ", __FILE__, __LINE__, #cond); printf(__VA_ARGS__); printf("\n"); } } while (0)
+inline int test_result() {
+  printf("%s: %d failure(s)\n", (nb_failures == 0) ? "PASSED" : "FAILED", nb_failures);
+  return (nb_failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Commands exercising all the translators, each encoder supporting only some of them
+inline std::vector< BleAdvGenCmd > sample_commands() {
+  std::vector< BleAdvGenCmd > cmds;
+  auto add = [&](CommandType type, uint8_t param = 0, float arg0 = 0, float arg1 = 0) {
+    BleAdvGenCmd cmd(type);
+    cmd.param = param;
+    cmd.args[0] = arg0;
+    cmd.args[1] = arg1;
+    cmds.push_back(cmd);
+  };
+  add(CommandType::PAIR);
+  add(CommandType::UNPAIR);
+  add(CommandType::ALL_OFF);
+  add(CommandType::LIGHT_ON);
+  add(CommandType::LIGHT_OFF);
+  add(CommandType::LIGHT_SEC_ON);
+  add(CommandType::LIGHT_SEC_OFF);
+  add(CommandType::LIGHT_DIM, 0, 0.5f);
+  add(CommandType::LIGHT_CCT, 0, 0.25f);
+  add(CommandType::LIGHT_WCOLOR, 0, 0.8f, 0.2f);
+  add(CommandType::LIGHT_WCOLOR, 3, 0.1f, 0.1f);
+  add(CommandType::FAN_DIR, 0, 1);
+  add(CommandType::FAN_OSC, 0, 1);
+  add(CommandType::FAN_ONOFF_SPEED, 0, 2, 6);
+  add(CommandType::FAN_ONOFF_SPEED, 0, 0, 0);
+  return cmds;
+}
+
+// Controller parameters in the range accepted by each encoder
+inline ControllerParam_t sample_controller(BleAdvEncoder * encoder, uint32_t rnd) {
+  ControllerParam_t cont;
+  cont.id_ = rnd * 2654435761UL;
+  // zhijia v0 only encodes 16 bits ids
+  if (encoder->get_variant() == "v0") cont.id_ &= 0xFFFF;
+  cont.tx_count_ = rnd & 0x7F;
+  cont.index_ = rnd & 0x0F;
+  cont.seed_ = 1 + (rnd % 0xFFF0);
+  return cont;
+}
+
+inline std::string to_hex(const uint8_t * buf, size_t len) {
+  std::string hex;
+  char byte[4];
+  for (size_t i = 0; i < len; ++i) {
+    snprintf(byte, sizeof(byte), (i == 0) ? "%02X" : ".%02X", buf[i]);
+    hex += byte;
+  }
+  return hex;
+}
+
+inline BleAdvParam param_from_hex(std::string hex) {
+  BleAdvParam param;
+  param.from_hex_string(hex);
+  return param;
+}
+
+inline std::vector< BleAdvEncoder * > get_host_encoders(BleAdvHandler & handler) {
+  std::vector< BleAdvEncoder * > encoders;
+  for (const char * id : esphome::HOST_ENCODER_IDS) {
+    encoders.push_back(handler.get_encoder(id));
+  }
+  return encoders;
+}
+
+// Mean duration of the operation in ns, over enough iterations for the measure to be significant
+template< typename Op > double time_ns(size_t nb_iterations, Op && op) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < nb_iterations; ++i) {
+    op(i);
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration< double, std::nano >(end - start).count() / nb_iterations;
+}
+
+// Prevents the compiler from optimizing out the result of a benchmarked operation
+template< typename T > inline void keep(const T & value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+} // namespace host
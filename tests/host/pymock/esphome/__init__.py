@@ -0,0 +1 @@
+# Minimal stand-in of the esphome package, enough to load the components definitions on the host
@@ -0,0 +1,44 @@
+# Stand-in of esphome.codegen: the expressions added are collected as C++ statements in OUT
+
+OUT = []
+
+
+class MockObj:
+    def __init__(self, name):
+        self.name = name
+
+    def __str__(self):
+        return self.name
+
+    def __repr__(self):
+        return self.name
+
+    def __getattr__(self, attr):
+        if attr.startswith("__"):
+            raise AttributeError(attr)
+        return MockObj(f"{self.name}::{attr}")
+
+    def namespace(self, name):
+        return MockObj(f"{self.name}::{name}")
+
+    def class_(self, name, *parents):
+        return MockObj(f"{self.name}::{name}")
+
+    def enum(self, name, is_class=False):
+        return MockObj(f"{self.name}::{name}")
+
+
+class RawExpression:
+    def __init__(self, text):
+        self.text = text
+
+    def __str__(self):
+        return self.text
+
+
+esphome_ns = MockObj("esphome")
+Component = MockObj("esphome::Component")
+
+
+def add(expression):
+    OUT.append(str(expression))
@@ -0,0 +1,21 @@
+# Stand-in of esphome.config_validation: the schemas are built but never validated
+
+
+def _any(*args, **kwargs):
+    return _any
+
+
+class _Schema(dict):
+    def extend(self, *args, **kwargs):
+        return self
+
+
+ENTITY_BASE_SCHEMA = _Schema()
+
+
+def Schema(*args, **kwargs):
+    return _Schema()
+
+
+def __getattr__(name):
+    return _any
@@ -0,0 +1,5 @@
+# Stand-in of esphome.const
+
+
+def __getattr__(name):
+    return name.lower()
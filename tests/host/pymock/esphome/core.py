@@ -0,0 +1,7 @@
+# Stand-in of esphome.core
+
+
+class ID:
+    def __init__(self, id, type=None):
+        self.id = id
+        self.type = type
@@ -0,0 +1,5 @@
+#pragma once
+
+// Host stand-in of the ESP32 hardware AES: the software implementation is used
+#include <mbedtls/aes.h>
+#define ESP_AES_ENCRYPT MBEDTLS_AES_ENCRYPT
@@ -0,0 +1,98 @@
+#pragma once
+
+// Host stand-in of the ESP-IDF GAP API: only the types, events and functions used by ble_adv_handler.
+// The functions are implemented by the simulated GAP layer of host_sim.cpp.
+
+#include <cstdint>
+#include <cstddef>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERROR_CHECK_WITHOUT_ABORT(x) (x)
+
+#define ESP_BLE_AD_TYPE_FLAG 0x01
+#define ESP_BLE_AD_TYPE_16SRV_CMPL 0x03
+#define ESP_BLE_AD_TYPE_SERVICE_DATA 0x16
+#define ESP_BLE_AD_MANUFACTURER_SPECIFIC_TYPE 0xFF
+
+#define ESP_BD_ADDR_LEN 6
+typedef uint8_t esp_bd_addr_t[ESP_BD_ADDR_LEN];
+
+typedef enum { ADV_TYPE_IND = 0x00, ADV_TYPE_NONCONN_IND = 0x03 } esp_ble_adv_type_t;
+typedef enum { BLE_ADDR_TYPE_PUBLIC = 0x00 } esp_ble_addr_type_t;
+typedef enum { ADV_CHNL_ALL = 0x07 } esp_ble_adv_channel_t;
+typedef enum { ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY = 0x00 } esp_ble_adv_filter_t;
+typedef enum { ESP_BT_STATUS_SUCCESS = 0, ESP_BT_STATUS_FAIL = 1 } esp_bt_status_t;
+
+typedef struct {
+  uint16_t adv_int_min;
+  uint16_t adv_int_max;
+  esp_ble_adv_type_t adv_type;
+  esp_ble_addr_type_t own_addr_type;
+  esp_bd_addr_t peer_addr;
+  esp_ble_addr_type_t peer_addr_type;
+  esp_ble_adv_channel_t channel_map;
+  esp_ble_adv_filter_t adv_filter_policy;
+} esp_ble_adv_params_t;
+
+typedef enum {
+  ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT = 1,
+  ESP_GAP_BLE_ADV_START_COMPLETE_EVT = 6,
+  ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT = 17,
+  ESP_GAP_BLE_EXT_ADV_SET_PARAMS_COMPLETE_EVT = 30,
+  ESP_GAP_BLE_EXT_ADV_DATA_SET_COMPLETE_EVT,
+  ESP_GAP_BLE_EXT_ADV_START_COMPLETE_EVT,
+  ESP_GAP_BLE_EXT_ADV_STOP_COMPLETE_EVT,
+} esp_gap_ble_cb_event_t;
+
+typedef union {
+  struct { esp_bt_status_t status; } adv_data_raw_cmpl;
+  struct { esp_bt_status_t status; } adv_start_cmpl;
+  struct { esp_bt_status_t status; } adv_stop_cmpl;
+  struct { esp_bt_status_t status; uint8_t instance; } ext_adv_set_params;
+  struct { esp_bt_status_t status; uint8_t instance; } ext_adv_data_set;
+  struct { esp_bt_status_t status; uint8_t instance_num; uint8_t instance[10]; } ext_adv_start;
+  struct { esp_bt_status_t status; uint8_t instance_num; uint8_t instance[10]; } ext_adv_stop;
+} esp_ble_gap_cb_param_t;
+
+esp_err_t esp_ble_gap_config_adv_data_raw(uint8_t *raw_data, uint32_t raw_data_len);
+esp_err_t esp_ble_gap_start_advertising(esp_ble_adv_params_t *adv_params);
+esp_err_t esp_ble_gap_stop_advertising(void);
+
+// BLE 5 extended advertising
+typedef uint16_t esp_ble_ext_adv_type_mask_t;
+#define ESP_BLE_LEGACY_ADV_TYPE_NONCONN_IND 0x0010
+#define EXT_ADV_TX_PWR_NO_PREFERENCE 127
+typedef uint8_t esp_ble_gap_pri_phy_t;
+typedef uint8_t esp_ble_gap_phy_t;
+#define ESP_BLE_GAP_PRI_PHY_1M 1
+#define ESP_BLE_GAP_PHY_1M 1
+
+typedef struct {
+  esp_ble_ext_adv_type_mask_t type;
+  uint32_t interval_min;
+  uint32_t interval_max;
+  esp_ble_adv_channel_t channel_map;
+  esp_ble_addr_type_t own_addr_type;
+  esp_ble_addr_type_t peer_addr_type;
+  esp_bd_addr_t peer_addr;
+  esp_ble_adv_filter_t filter_policy;
+  int8_t tx_power;
+  esp_ble_gap_pri_phy_t primary_phy;
+  uint8_t max_skip;
+  esp_ble_gap_phy_t secondary_phy;
+  uint8_t sid;
+  bool scan_req_notif;
+} esp_ble_gap_ext_adv_params_t;
+
+typedef struct {
+  uint8_t instance;
+  int duration;
+  int max_events;
+} esp_ble_gap_ext_adv_t;
+
+esp_err_t esp_ble_gap_ext_adv_set_params(uint8_t instance, const esp_ble_gap_ext_adv_params_t *params);
+esp_err_t esp_ble_gap_config_ext_adv_data_raw(uint8_t instance, uint16_t length, const uint8_t *data);
+esp_err_t esp_ble_gap_ext_adv_start(uint8_t num_adv, const esp_ble_gap_ext_adv_t *ext_adv);
+esp_err_t esp_ble_gap_ext_adv_stop(uint8_t num_adv, const uint8_t *ext_adv_inst);
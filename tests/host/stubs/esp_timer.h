@@ -0,0 +1,22 @@
+#pragma once
+
+// Host stand-in of the ESP-IDF esp_timer API, driven by the simulated clock of host_sim.cpp
+
+#include <cstdint>
+
+typedef struct esp_timer * esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void * arg);
+typedef enum { ESP_TIMER_TASK } esp_timer_dispatch_t;
+
+typedef struct {
+  esp_timer_cb_t callback;
+  void * arg;
+  esp_timer_dispatch_t dispatch_method;
+  const char * name;
+  bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+int esp_timer_create(const esp_timer_create_args_t * create_args, esp_timer_handle_t * out_handle);
+int esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us);
+int esp_timer_stop(esp_timer_handle_t timer);
+int64_t esp_timer_get_time();
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace api {
+
+class CustomAPIDevice {
+public:
+  template< typename T, typename... Ts >
+  void register_service(void (T::*callback)(Ts...), const std::string & name, const std::vector< std::string > & arg_names = {}) {}
+};
+
+} // namespace api
+} // namespace esphome
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <esp_gap_ble_api.h>
+
+namespace esphome {
+namespace esp32_ble {
+
+class GAPEventHandler {
+public:
+  virtual void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t * param) = 0;
+};
+
+// Only one handler: the GAP events of the simulated GAP layer are delivered to it
+class ESP32BLE {
+public:
+  void register_gap_event_handler(GAPEventHandler * handler) { this->gap_event_handler_ = handler; }
+  GAPEventHandler * get_gap_event_handler() const { return this->gap_event_handler_; }
+
+protected:
+  GAPEventHandler * gap_event_handler_{nullptr};
+};
+
+extern ESP32BLE * global_ble;
+
+} // namespace esp32_ble
+} // namespace esphome
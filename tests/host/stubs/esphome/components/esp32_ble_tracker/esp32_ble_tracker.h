@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+namespace esphome {
+namespace esp32_ble_tracker {
+
+struct ble_scan_result_evt_param {
+  uint8_t ble_adv[62];
+  uint8_t adv_data_len;
+};
+
+class ESPBTDevice {
+public:
+  // host only: set the raw advertisement as received by the scanner
+  void set_raw_packet(const uint8_t * buf, uint8_t len) {
+    std::memcpy(this->scan_result_.ble_adv, buf, len);
+    this->scan_result_.adv_data_len = len;
+  }
+
+protected:
+  ble_scan_result_evt_param scan_result_{};
+};
+
+} // namespace esp32_ble_tracker
+} // namespace esphome
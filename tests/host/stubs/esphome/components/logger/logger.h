@@ -0,0 +1,30 @@
+#pragma once
+
+#include "esphome/core/log.h"
+#include <map>
+#include <string>
+
+namespace esphome {
+namespace logger {
+
+// Same level handling as the ESPHome logger, including the per tag levels lookup building a std::string
+class Logger {
+public:
+  void set_log_level(int level) { this->current_level_ = level; }
+  void set_log_level(const std::string & tag, int log_level) { this->log_levels_[tag] = log_level; }
+  int get_log_level() { return this->current_level_; }
+  int level_for(const char * tag) {
+    auto it = this->log_levels_.find(tag);
+    if (it != this->log_levels_.end()) return it->second;
+    return this->current_level_;
+  }
+
+protected:
+  int current_level_{ESPHOME_LOG_LEVEL_VERY_VERBOSE};
+  std::map< std::string, int > log_levels_;
+};
+
+extern Logger * global_logger;
+
+} // namespace logger
+} // namespace esphome
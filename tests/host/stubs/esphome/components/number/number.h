@@ -0,0 +1,26 @@
+#pragma once
+
+#include "esphome/core/entity_base.h"
+
+namespace esphome {
+namespace number {
+
+class NumberTraits {
+public:
+  void set_min_value(float min_value) {}
+  void set_max_value(float max_value) {}
+  void set_step(float step) {}
+};
+
+class Number: public EntityBase {
+public:
+  float state{0};
+  NumberTraits traits;
+  void publish_state(float state) { this->state = state; }
+
+protected:
+  virtual void control(float value) = 0;
+};
+
+} // namespace number
+} // namespace esphome
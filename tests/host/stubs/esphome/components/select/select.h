@@ -0,0 +1,32 @@
+#pragma once
+
+#include "esphome/core/entity_base.h"
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace select {
+
+class SelectTraits {
+public:
+  void set_options(std::vector< std::string > options) { this->options_ = std::move(options); }
+  const std::vector< std::string > & get_options() const { return this->options_; }
+
+protected:
+  std::vector< std::string > options_;
+};
+
+class Select: public EntityBase {
+public:
+  std::string state;
+  SelectTraits traits;
+  void publish_state(const std::string & state) { this->state = state; }
+  void add_on_state_callback(std::function< void(std::string, size_t) > && callback) {}
+
+protected:
+  virtual void control(const std::string & value) = 0;
+};
+
+} // namespace select
+} // namespace esphome
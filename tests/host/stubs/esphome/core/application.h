@@ -0,0 +1,16 @@
+#pragma once
+
+#include "esphome/components/select/select.h"
+#include "esphome/components/number/number.h"
+
+namespace esphome {
+
+class Application {
+public:
+  void register_select(select::Select * obj) {}
+  void register_number(number::Number * obj) {}
+};
+
+extern Application App;
+
+} // namespace esphome
@@ -0,0 +1,6 @@
+#pragma once
+
+// Host build configuration: API services, BLE tracker capture and logger enabled, no ESP32 hardware
+#define USE_API
+#define USE_ESP32_BLE_CLIENT
+#define USE_LOGGER
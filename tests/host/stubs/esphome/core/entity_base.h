@@ -0,0 +1,25 @@
+#pragma once
+
+#include "string_ref.h"
+#include <cstdint>
+#include <string>
+
+namespace esphome {
+
+enum EntityCategory : uint8_t { ENTITY_CATEGORY_NONE = 0, ENTITY_CATEGORY_CONFIG = 1, ENTITY_CATEGORY_DIAGNOSTIC = 2 };
+
+class EntityBase {
+public:
+  const StringRef get_name() const { return StringRef(this->name_); }
+  void set_name(const char * name) { this->name_ = name; }
+  std::string get_object_id() const { return this->object_id_; }
+  void set_object_id(const char * object_id) { this->object_id_ = object_id; }
+  uint32_t get_object_id_hash() { return 0; }
+  void set_entity_category(EntityCategory entity_category) {}
+
+protected:
+  std::string name_;
+  std::string object_id_;
+};
+
+} // namespace esphome
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstdint>
+
+// Simulated clock of host_sim.cpp
+namespace esphome {
+uint32_t millis();
+uint32_t micros();
+}
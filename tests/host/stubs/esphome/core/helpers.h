@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <algorithm>
+
+namespace esphome {
+
+uint16_t crc16(const uint8_t * data, uint16_t len, uint16_t crc = 0xffff, uint16_t reverse_poly = 0xa001,
+               bool refin = false, bool refout = false);
+uint16_t crc16be(const uint8_t * data, uint16_t len, uint16_t crc = 0, uint16_t poly = 0x1021,
+                 bool refin = false, bool refout = false);
+std::string format_hex_pretty(const uint8_t * data, size_t length);
+uint32_t fnv1_hash(const std::string & str);
+
+template< typename T > class Parented {
+public:
+  Parented() {}
+  Parented(T * parent): parent_(parent) {}
+  T * get_parent() const { return this->parent_; }
+  void set_parent(T * parent) { this->parent_ = parent; }
+
+protected:
+  T * parent_{nullptr};
+};
+
+// Counts the locks taken, so that the tests can check the advertiser is not polled
+class Mutex {
+public:
+  void lock() { this->mutex_.lock(); ++nb_locks; }
+  bool try_lock() { return this->mutex_.try_lock(); }
+  void unlock() { this->mutex_.unlock(); }
+  static uint32_t nb_locks;
+
+protected:
+  std::mutex mutex_;
+};
+
+class LockGuard {
+public:
+  LockGuard(Mutex & mutex): mutex_(mutex) { this->mutex_.lock(); }
+  ~LockGuard() { this->mutex_.unlock(); }
+
+protected:
+  Mutex & mutex_;
+};
+
+} // namespace esphome
@@ -0,0 +1,32 @@
+#pragma once
+
+// Host stand-in of the ESPHome log macros: compiled in up to ESPHOME_LOG_LEVEL,
+// then filtered at runtime by the logger as done by esp_log_printf_
+
+#define ESPHOME_LOG_LEVEL_NONE 0
+#define ESPHOME_LOG_LEVEL_ERROR 1
+#define ESPHOME_LOG_LEVEL_WARN 2
+#define ESPHOME_LOG_LEVEL_INFO 3
+#define ESPHOME_LOG_LEVEL_CONFIG 4
+#define ESPHOME_LOG_LEVEL_DEBUG 5
+#define ESPHOME_LOG_LEVEL_VERBOSE 6
+#define ESPHOME_LOG_LEVEL_VERY_VERBOSE 7
+
+#ifndef ESPHOME_LOG_LEVEL
+#define ESPHOME_LOG_LEVEL ESPHOME_LOG_LEVEL_DEBUG
+#endif
+
+namespace esphome {
+void esp_log_printf_(int level, const char * tag, int line, const char * format, ...) __attribute__((format(printf, 4, 5)));
+}
+
+#define ESPHOME_LOG_AT(level, tag, ...) \
+  (((level) <= ESPHOME_LOG_LEVEL) ? ::esphome::esp_log_printf_(level, tag, __LINE__, __VA_ARGS__) : (void) 0)
+
+#define ESP_LOGE(tag, ...) ESPHOME_LOG_AT(ESPHOME_LOG_LEVEL_ERROR, tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) ESPHOME_LOG_AT(ESPHOME_LOG_LEVEL_WARN, tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) ESPHOME_LOG_AT(ESPHOME_LOG_LEVEL_INFO, tag, __VA_ARGS__)
+#define ESP_LOGCONFIG(tag, ...) ESPHOME_LOG_AT(ESPHOME_LOG_LEVEL_CONFIG, tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) ESPHOME_LOG_AT(ESPHOME_LOG_LEVEL_DEBUG, tag, __VA_ARGS__)
+#define ESP_LOGV(tag, ...) ESPHOME_LOG_AT(ESPHOME_LOG_LEVEL_VERBOSE, tag, __VA_ARGS__)
+#define ESP_LOGVV(tag, ...) ESPHOME_LOG_AT(ESPHOME_LOG_LEVEL_VERY_VERBOSE, tag, __VA_ARGS__)
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+
+// Host stand-in of the ESPHome preferences: nothing is ever restored
+namespace esphome {
+
+class ESPPreferenceObject {
+public:
+  ESPPreferenceObject(void * backend = nullptr) {}
+  template< typename T > bool save(const T * src) { return true; }
+  template< typename T > bool load(T * dest) { return false; }
+};
+
+class ESPPreferences {
+public:
+  template< typename T > ESPPreferenceObject make_preference(uint32_t type) { return ESPPreferenceObject(); }
+};
+
+extern ESPPreferences * global_preferences;
+
+} // namespace esphome
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+
+namespace esphome {
+
+class StringRef {
+public:
+  StringRef(const std::string & str): str_(str) {}
+  operator std::string() const { return this->str_; }
+  const char * c_str() const { return this->str_.c_str(); }
+
+protected:
+  std::string str_;
+};
+
+} // namespace esphome
@@ -0,0 +1,255 @@
+// Advertiser run against the simulated GAP layer, with the legacy and extended backends:
+//   - packets on air as soon as submitted, then for their duration each, with no gap longer than the GAP latency
+//   - nothing done by the main loop while the slots wait for their timer or a completion event
+//   - lost completion events and failed requests recovered without a busy loop
+//   - captured packets dropped on a full queue decoded when captured again
+
+#include "host_test.h"
+
+#include "esphome/components/esp32_ble_tracker/esp32_ble_tracker.h"
+
+#include <vector>
+
+using namespace host;
+
+static constexpr int64_t MS = 1000;
+static constexpr uint16_t DURATION = 100;
+
+static void handler_loop(void * arg) { static_cast< BleAdvHandler * >(arg)->loop(); }
+
+// Handlers never destroyed, as on the device, the simulated stack keeping a pointer to the last one set up
+static BleAdvHandler * make_handler(size_t max_adv_sets, bool hot_swap) {
+  host::reset();
+  BleAdvHandler * handler = new BleAdvHandler();
+  handler->set_max_adv_sets(max_adv_sets);
+  handler->set_hot_swap(hot_swap);
+  handler->setup();
+  return handler;
+}
+
+// Message of nb_packets distinct packets, identified by their first manufacturer data byte
+static uint16_t advertise(BleAdvHandler * handler, uint8_t id, size_t nb_packets = 1,
+                          CommandType cmd_type = CommandType::LIGHT_ON, uint16_t duration = DURATION) {
+  BleAdvParams params;
+  for (size_t i = 0; i < nb_packets; ++i) {
+    uint8_t raw[] = {0x02, 0x01, 0x1A, 0x05, 0xFF, (uint8_t)(id + i), 0x55, 0xAA, 0x00};
+    BleAdvParam * param = params.emplace_back();
+    param->from_raw(raw, sizeof(raw));
+    param->duration_ = duration;
+  }
+  BleAdvSchedParam sched;
+  sched.cmd_type_ = cmd_type;
+  sched.min_tx_duration_ = duration * nb_packets;
+  sched.max_tx_duration_ = 3000;
+  return handler->add_to_advertiser(params, sched);
+}
+
+static uint8_t on_air_id(const OnAir & rec) { return rec.data_[5]; }
+
+// Records per instance, in chronological order
+static std::vector< const OnAir * > instance_records(uint8_t instance) {
+  std::vector< const OnAir * > recs;
+  for (size_t i = 0; i < get_nb_on_air(); ++i) {
+    if (get_on_air(i).instance_ == instance) recs.push_back(&get_on_air(i));
+  }
+  return recs;
+}
+
+static int64_t airtime_of(uint8_t id) {
+  int64_t airtime = 0;
+  for (size_t i = 0; i < get_nb_on_air(); ++i) {
+    const OnAir & rec = get_on_air(i);
+    if (on_air_id(rec) != id) continue;
+    airtime += ((rec.end_us_ < 0) ? now_us() : rec.end_us_) - rec.start_us_;
+  }
+  return airtime;
+}
+
+static void test_single_packet(size_t nb_sets) {
+  printf("single packet, %zu set(s)\n", nb_sets);
+  BleAdvHandler * handler = make_handler(nb_sets, true);
+  advertise(handler, 0x10);
+  run_for(5 * MS, handler_loop, handler);
+  HOST_CHECK(get_nb_on_air() == 1, "%zu records", get_nb_on_air());
+  if (get_nb_on_air() == 0) return;
+  HOST_CHECK(get_on_air(0).start_us_ <= 1 * MS, "on air after %lld us", (long long)get_on_air(0).start_us_);
+
+  // alone: kept on air, with neither GAP requests nor lock taken by the loop passes
+  run_for(200 * MS, handler_loop, handler);
+  uint32_t requests = get_nb_gap_requests();
+  uint32_t locks = esphome::Mutex::nb_locks;
+  run_for(1000 * MS, handler_loop, handler);
+  HOST_CHECK(get_nb_gap_requests() == requests, "%u GAP requests while alone", get_nb_gap_requests() - requests);
+  HOST_CHECK(esphome::Mutex::nb_locks == locks, "%u locks while alone", esphome::Mutex::nb_locks - locks);
+  HOST_CHECK((get_nb_on_air() == 1) && (get_on_air(0).end_us_ < 0), "%zu records", get_nb_on_air());
+}
+
+// nb_packets packets sharing nb_sets slots: each on air for its duration in turn, switched without delay
+static void test_rotation(size_t nb_sets, bool hot_swap, size_t nb_packets) {
+  printf("rotation of %zu packets, %zu set(s), hot swap %s\n", nb_packets, nb_sets, hot_swap ? "on" : "off");
+  BleAdvHandler * handler = make_handler(nb_sets, hot_swap);
+  advertise(handler, 0x20, nb_packets);
+  run_for(3000 * MS, handler_loop, handler);
+
+  int64_t max_gap = hot_swap ? 0 : 3 * GapConfig().latency_us;
+  int64_t total = 0;
+  for (uint8_t instance = 0; instance < nb_sets; ++instance) {
+    std::vector< const OnAir * > recs = instance_records(instance);
+    HOST_CHECK(!recs.empty(), "instance %d never used", instance);
+    for (size_t i = 0; i < recs.size(); ++i) {
+      const OnAir & rec = *recs[i];
+      int64_t end = (rec.end_us_ < 0) ? now_us() : rec.end_us_;
+      total += end - rec.start_us_;
+      if (i + 1 == recs.size()) continue;
+      int64_t airtime = end - rec.start_us_;
+      HOST_CHECK(std::abs(airtime - DURATION * MS) <= 1 * MS, "instance %d, record %zu on air for %lld us",
+                 instance, i, (long long)airtime);
+      int64_t gap = recs[i + 1]->start_us_ - end;
+      HOST_CHECK((gap >= 0) && (gap <= max_gap), "instance %d, record %zu followed after %lld us",
+                 instance, i, (long long)gap);
+      if ((nb_sets == 1) && (nb_packets == 2)) {
+        HOST_CHECK(on_air_id(rec) != on_air_id(*recs[i + 1]), "record %zu: same packet twice in a row", i);
+      }
+    }
+  }
+  // the slots shared equally
+  for (size_t i = 0; i < nb_packets; ++i) {
+    int64_t airtime = airtime_of(0x20 + i);
+    int64_t expected = total / nb_packets;
+    HOST_CHECK(std::abs(airtime - expected) <= expected / 10, "packet %zu on air for %lld us, expected %lld",
+               i, (long long)airtime, (long long)expected);
+  }
+}
+
+static void test_removal(size_t nb_sets) {
+  printf("removal, %zu set(s)\n", nb_sets);
+  BleAdvHandler * handler = make_handler(nb_sets, true);
+  uint16_t id1 = advertise(handler, 0x30, 2);
+  uint16_t id2 = advertise(handler, 0x40);
+  run_for(1000 * MS, handler_loop, handler);
+  int64_t removed = now_us();
+  handler->remove_from_advertiser(id1);
+  handler->remove_from_advertiser(id2);
+  run_for(1000 * MS, handler_loop, handler);
+  size_t nb_records = get_nb_on_air();
+  for (size_t i = 0; i < nb_records; ++i) {
+    const OnAir & rec = get_on_air(i);
+    HOST_CHECK((rec.end_us_ >= 0) && (rec.end_us_ <= removed + (DURATION + 1) * MS), "record %zu ended at %lld us",
+               i, (long long)rec.end_us_);
+  }
+  uint32_t requests = get_nb_gap_requests();
+  run_for(1000 * MS, handler_loop, handler);
+  HOST_CHECK((get_nb_on_air() == nb_records) && (get_nb_gap_requests() == requests), "activity once empty");
+}
+
+// High priority packet put on air at once, not waiting for the end of the low priority one on air
+static void test_preemption(size_t nb_sets) {
+  printf("preemption, %zu set(s)\n", nb_sets);
+  BleAdvHandler * handler = make_handler(nb_sets, true);
+  for (size_t i = 0; i < nb_sets; ++i) {
+    advertise(handler, 0x50 + i, 1, CommandType::LIGHT_DIM, 1000);
+  }
+  run_for(20 * MS, handler_loop, handler);
+  int64_t submitted = now_us();
+  advertise(handler, 0x60, 1, CommandType::PAIR);
+  run_for(5 * MS, handler_loop, handler);
+  bool found = false;
+  for (size_t i = 0; i < get_nb_on_air(); ++i) {
+    const OnAir & rec = get_on_air(i);
+    if (on_air_id(rec) != 0x60) continue;
+    found = true;
+    HOST_CHECK(rec.start_us_ - submitted <= 1 * MS, "high priority on air after %lld us",
+               (long long)(rec.start_us_ - submitted));
+  }
+  HOST_CHECK(found, "high priority packet not on air");
+}
+
+// Completion events never received: the slot reset after the event timeout, without request in between
+static void test_lost_events(size_t nb_sets) {
+  printf("lost events, %zu set(s)\n", nb_sets);
+  BleAdvHandler * handler = make_handler(nb_sets, true);
+  gap_config.lose_events = true;
+  advertise(handler, 0x70);
+  run_for(10 * MS, handler_loop, handler);
+  uint32_t requests = get_nb_gap_requests();
+  run_for(900 * MS, handler_loop, handler);
+  HOST_CHECK(get_nb_gap_requests() == requests, "%u requests while waiting", get_nb_gap_requests() - requests);
+  // the reset after 1s is lost too, the next attempt at 2s succeeds
+  run_for(590 * MS, handler_loop, handler);
+  gap_config.lose_events = false;
+  run_for(1500 * MS, handler_loop, handler);
+  HOST_CHECK(get_nb_on_air() == 1, "%zu records", get_nb_on_air());
+  if (get_nb_on_air() == 0) return;
+  int64_t start = get_on_air(0).start_us_;
+  HOST_CHECK((start >= 2000 * MS) && (start <= 2010 * MS), "on air at %lld us", (long long)start);
+}
+
+// Requests failing: retried at the retry delay, not at each loop pass
+static void test_failed_requests(size_t nb_sets) {
+  printf("failed requests, %zu set(s)\n", nb_sets);
+  BleAdvHandler * handler = make_handler(nb_sets, true);
+  gap_config.fail_requests = true;
+  advertise(handler, 0x80);
+  run_for(1000 * MS, handler_loop, handler);
+  // one attempt per retry delay, of at most the 3 requests of the extended backend
+  HOST_CHECK(get_nb_gap_requests() <= 11 * 3, "%u requests in 1s", get_nb_gap_requests());
+  HOST_CHECK(get_nb_on_air() == 0, "%zu records", get_nb_on_air());
+  gap_config.fail_requests = false;
+  int64_t fixed = now_us();
+  run_for(200 * MS, handler_loop, handler);
+  HOST_CHECK(get_nb_on_air() == 1, "%zu records", get_nb_on_air());
+  if (get_nb_on_air() == 0) return;
+  HOST_CHECK(get_on_air(0).start_us_ - fixed <= 101 * MS, "on air after %lld us",
+             (long long)(get_on_air(0).start_us_ - fixed));
+}
+
+// Counters of the captured packets
+class CaptureHandler: public BleAdvHandler
+{
+public:
+  uint32_t get_nb_processed() const { return this->nb_capture_processed_; }
+  uint32_t get_nb_dropped() const { return this->nb_capture_dropped_; }
+};
+
+static void capture(BleAdvHandler * handler, uint8_t id) {
+  uint8_t raw[] = {0x02, 0x01, 0x1A, 0x05, 0xFF, id, 0x55, 0xAA, 0x00};
+  esphome::esp32_ble_tracker::ESPBTDevice device;
+  device.set_raw_packet(raw, sizeof(raw));
+  handler->capture(device);
+}
+
+// Packet dropped on a full queue: not remembered as captured, decoded when captured again
+static void test_capture_dropped() {
+  printf("capture dropped\n");
+  host::reset();
+  CaptureHandler * handler = new CaptureHandler();
+  handler->set_capture_dedup_size(64);
+  handler->set_capture_queue_size(1);
+  handler->setup();
+  capture(handler, 0x90);
+  capture(handler, 0x91);
+  HOST_CHECK(handler->get_nb_dropped() == 1, "%u dropped", handler->get_nb_dropped());
+  run_for(5 * MS, handler_loop, handler);
+  HOST_CHECK(handler->get_nb_processed() == 1, "%u processed", handler->get_nb_processed());
+  // the decoded one is not decoded again, the dropped one is
+  capture(handler, 0x90);
+  capture(handler, 0x91);
+  run_for(5 * MS, handler_loop, handler);
+  HOST_CHECK(handler->get_nb_dropped() == 1, "%u dropped", handler->get_nb_dropped());
+  HOST_CHECK(handler->get_nb_processed() == 2, "%u processed", handler->get_nb_processed());
+}
+
+int main() {
+  for (size_t nb_sets : {1, 2}) {
+    test_single_packet(nb_sets);
+    test_rotation(nb_sets, true, 2);
+    test_rotation(nb_sets, false, 2);
+    test_rotation(nb_sets, true, 3);
+    test_removal(nb_sets);
+    test_preemption(nb_sets);
+    test_lost_events(nb_sets);
+    test_failed_requests(nb_sets);
+  }
+  test_capture_dropped();
+  return test_result();
+}
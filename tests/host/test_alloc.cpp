@@ -0,0 +1,112 @@
+// Heap allocations of the command path, from BleAdvEntity::command to the packets on air, counted by the
+// replacement of the global operator new of host_sim.cpp:
+//   - controllers of all the encodings with all their variants selected, some of them coalescing their commands
+//   - entities sending commands continuously, superseding the ones still pending or advertised
+//   - none expected in steady state with a logger at INFO level, only the DEBUG logs building strings
+
+#include "host_test.h"
+#include "esphome/components/ble_adv_controller/ble_adv_controller.h"
+
+#include <string>
+#include <vector>
+
+using namespace host;
+using esphome::ble_adv_controller::BleAdvController;
+using esphome::ble_adv_controller::BleAdvEntity;
+
+static constexpr int64_t MS = 1000;
+// a command per entity at each step, within what a single advertising slot can serve
+static constexpr int64_t STEP = 2000 * MS;
+
+class HostEntity: public BleAdvEntity
+{
+public:
+  void dump_config() override {}
+  void send(CommandType cmd, float value1 = 0, float value2 = 0) { this->command(cmd, value1, value2); }
+};
+
+static void handler_loop(void * arg) { static_cast< BleAdvHandler * >(arg)->loop(); }
+
+// Components never destroyed, as on the device
+static BleAdvHandler * make_handler(std::vector< HostEntity * > & entities) {
+  host::reset();
+  BleAdvHandler * handler = new BleAdvHandler();
+  add_host_encoders(*handler);
+  // room for the packets of all the controllers sending at once, none being dropped
+  handler->set_max_packets(64);
+  handler->setup();
+
+  std::vector< std::string > encodings;
+  for (const char * id : esphome::HOST_ENCODER_IDS) {
+    std::string encoding = std::string(id).substr(0, std::string(id).find(" - "));
+    if (std::find(encodings.begin(), encodings.end(), encoding) == encodings.end()) encodings.push_back(encoding);
+  }
+  // 2 controllers per encoding, the second one coalescing and merging the brightness / color temperature
+  for (size_t i = 0; i < 2 * encodings.size(); ++i) {
+    const std::string & encoding = encodings[i / 2];
+    BleAdvController * controller = new BleAdvController();
+    controller->set_parent(handler);
+    controller->set_name("controller");
+    controller->set_forced_id(0x1000 + i);
+    controller->set_min_tx_duration(100, 100, 500, 10);
+    controller->set_max_tx_duration(1000);
+    controller->set_seq_duration(30);
+    controller->set_coalescing_window((i % 2) ? 300 : 0);
+    controller->set_merge_dim_cct(i % 2);
+    std::vector< std::string > ids = handler->get_ids(encoding);
+    controller->set_encoding_and_variant(encoding, ids[1].substr(ids[1].find(" - ") + 3));
+    controller->refresh_encoder(ids[0], 0);
+    controller->setup();
+    HostEntity * entity = new HostEntity();
+    entity->set_parent(controller);
+    entities.push_back(entity);
+  }
+  return handler;
+}
+
+// Each entity sends the next command of the cycle at each step
+static void send_commands(std::vector< HostEntity * > & entities, size_t step) {
+  for (size_t i = 0; i < entities.size(); ++i) {
+    float level = 0.1f * ((step + i) % 10);
+    switch ((step + i) % 6) {
+      case 0: entities[i]->send(CommandType::LIGHT_ON); break;
+      case 1: entities[i]->send(CommandType::LIGHT_DIM, level); break;
+      case 2: entities[i]->send(CommandType::LIGHT_CCT, level); break;
+      case 3: entities[i]->send(CommandType::FAN_ONOFF_SPEED, 2, 6); break;
+      case 4: entities[i]->send(CommandType::LIGHT_WCOLOR, level, 1.f - level); break;
+      default: entities[i]->send(CommandType::LIGHT_OFF); break;
+    }
+  }
+}
+
+struct Run {
+  size_t nb_allocs_;
+  size_t nb_commands_;
+  size_t nb_on_air_;
+};
+
+static Run run(BleAdvHandler * handler, std::vector< HostEntity * > & entities, size_t nb_steps) {
+  size_t allocs = get_nb_allocs();
+  size_t on_air = get_nb_on_air();
+  for (size_t step = 0; step < nb_steps; ++step) {
+    send_commands(entities, step);
+    run_for(STEP, handler_loop, handler);
+  }
+  return Run{get_nb_allocs() - allocs, nb_steps * entities.size(), get_nb_on_air() - on_air};
+}
+
+int main() {
+  host::set_log_level(ESPHOME_LOG_LEVEL_INFO);
+  std::vector< HostEntity * > entities;
+  BleAdvHandler * handler = make_handler(entities);
+  // warm up: the airtime sharing flows created on the first message of each controller
+  run(handler, entities, 10);
+
+  Run info = run(handler, entities, 100);
+  printf("INFO level: %zu allocations for %zu commands, %zu packets on air\n",
+         info.nb_allocs_, info.nb_commands_, info.nb_on_air_);
+  HOST_CHECK(info.nb_allocs_ == 0, "%zu allocations in steady state", info.nb_allocs_);
+  HOST_CHECK(info.nb_on_air_ > 0, "nothing on air");
+
+  return test_result();
+}
@@ -0,0 +1,105 @@
+// Queue of the pending commands of a controller, the commands being sent faster than advertised:
+//   - a command of each type always queued, the previous one of the same type being superseded
+//   - the CUSTOM commands from the services queued on top of them, the oldest one dropped when too many
+
+#include "host_test.h"
+#include "esphome/components/ble_adv_controller/ble_adv_controller.h"
+
+#include <string>
+
+using namespace host;
+using esphome::ble_adv_controller::BleAdvController;
+using esphome::ble_adv_controller::BleAdvEntity;
+
+static const CommandType COMMAND_TYPES[] = {
+  CommandType::PAIR, CommandType::UNPAIR, CommandType::ALL_OFF, CommandType::LIGHT_ON, CommandType::LIGHT_OFF,
+  CommandType::LIGHT_DIM, CommandType::LIGHT_CCT, CommandType::LIGHT_WCOLOR, CommandType::LIGHT_SEC_ON,
+  CommandType::LIGHT_SEC_OFF, CommandType::FAN_ONOFF_SPEED, CommandType::FAN_DIR, CommandType::FAN_OSC,
+};
+static_assert(sizeof(COMMAND_TYPES) / sizeof(COMMAND_TYPES[0]) == esphome::ble_adv_handler::NB_COMMAND_TYPES,
+              "command types");
+
+// Pending commands, never processed as the timers are not run
+class HostController: public BleAdvController
+{
+public:
+  using BleAdvController::MAX_CUSTOM_COMMANDS;
+  size_t get_nb_pending() const { return this->commands_.size(); }
+  size_t count(CommandType cmd_type) const {
+    return std::count_if(this->commands_.begin(), this->commands_.end(),
+                         [&](const QueueItem & q){ return q.gen_cmd_.cmd == cmd_type; });
+  }
+  uint8_t get_custom_cmd(size_t i) const {
+    for (const QueueItem & q : this->commands_) {
+      if ((q.gen_cmd_.cmd == CommandType::CUSTOM) && (i-- == 0)) return q.enc_cmd_.cmd;
+    }
+    return 0;
+  }
+};
+
+class HostEntity: public BleAdvEntity
+{
+public:
+  void dump_config() override {}
+  bool send(CommandType cmd, float value1 = 0, float value2 = 0) { return this->command(cmd, value1, value2); }
+};
+
+// Controller of the first encoding, all its variants selected, coalescing its commands or not
+static HostController * make_controller(HostEntity *& entity, uint32_t coalescing_window) {
+  host::reset();
+  BleAdvHandler * handler = new BleAdvHandler();
+  add_host_encoders(*handler);
+  handler->setup();
+  std::string id = esphome::HOST_ENCODER_IDS[0];
+  std::string encoding = id.substr(0, id.find(" - "));
+  HostController * controller = new HostController();
+  controller->set_parent(handler);
+  controller->set_name("controller");
+  controller->set_min_tx_duration(100, 100, 500, 10);
+  controller->set_coalescing_window(coalescing_window);
+  std::vector< std::string > ids = handler->get_ids(encoding);
+  controller->set_encoding_and_variant(encoding, ids[1].substr(ids[1].find(" - ") + 3));
+  controller->refresh_encoder(ids[0], 0);
+  controller->setup();
+  entity = new HostEntity();
+  entity->set_parent(controller);
+  return controller;
+}
+
+static void test_full_queue(uint32_t coalescing_window) {
+  printf("full queue, coalescing window %u ms\n", coalescing_window);
+  HostEntity * entity = nullptr;
+  HostController * controller = make_controller(entity, coalescing_window);
+  for (int i = 0; i < 10; ++i) {
+    controller->on_cmd(0x10 + i, 0, 0, 0, 0);
+    for (CommandType cmd_type : COMMAND_TYPES) entity->send(cmd_type, 0.1f * i);
+  }
+  // the latest command of each type or class, and the latest CUSTOM commands
+  size_t nb_classes = (coalescing_window > 0) ? esphome::ble_adv_handler::NB_COMMAND_TYPES - 2
+                                              : esphome::ble_adv_handler::NB_COMMAND_TYPES;
+  size_t max_custom = HostController::MAX_CUSTOM_COMMANDS;
+  HOST_CHECK(controller->count(CommandType::CUSTOM) == max_custom, "%zu CUSTOM commands pending",
+             controller->count(CommandType::CUSTOM));
+  HOST_CHECK(controller->get_nb_pending() == nb_classes + max_custom, "%zu commands pending",
+             controller->get_nb_pending());
+  for (size_t i = 0; i < max_custom; ++i) {
+    uint8_t expected = 0x10 + 10 - max_custom + i;
+    HOST_CHECK(controller->get_custom_cmd(i) == expected, "CUSTOM command %zu: %02X instead of %02X",
+               i, controller->get_custom_cmd(i), expected);
+  }
+  // still room for the commands of the entities, and for more CUSTOM ones
+  for (CommandType cmd_type : COMMAND_TYPES) {
+    entity->send(cmd_type, 1.f);
+    HOST_CHECK(controller->count(cmd_type) == 1, "command %d not queued", cmd_type);
+  }
+  controller->on_cmd(0x30, 0, 0, 0, 0);
+  HOST_CHECK(controller->get_custom_cmd(max_custom - 1) == 0x30, "last CUSTOM command not queued");
+  HOST_CHECK(entity->send(CommandType::LIGHT_ON), "LIGHT_ON not accepted");
+}
+
+int main() {
+  host::set_log_level(ESPHOME_LOG_LEVEL_INFO);
+  test_full_queue(0);
+  test_full_queue(300);
+  return test_result();
+}
@@ -0,0 +1,133 @@
+// Golden packets of every variant: each packet of the corpus must be encoded byte for byte identically
+// from its command, decoded back, re-encoded identically from the decoded command, and identified by the handler.
+// Usage: test_golden <corpus>             check the corpus
+//        test_golden --generate > corpus  generate it from the current encoders, to be reviewed before commit
+//
+// Corpus lines, fields separated by ';':
+//   packet;<encoder id>;<cmd>.<param1>.<args[0]>.<args[1]>.<args[2]>;<id>.<tx_count>.<index>.<seed>;<raw packet>
+//   sample;<encoder id>;<raw packet captured from a real device>
+
+#include "host_test.h"
+
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+using namespace esphome::ble_adv_handler;
+
+static std::vector< std::string > split(const std::string & line, char sep) {
+  std::vector< std::string > fields;
+  std::stringstream stream(line);
+  std::string field;
+  while (std::getline(stream, field, sep)) {
+    fields.push_back(field);
+  }
+  return fields;
+}
+
+static std::vector< uint32_t > parse_values(const std::string & str) {
+  std::vector< uint32_t > values;
+  for (auto & field : split(str, '.')) {
+    values.push_back(std::stoul(field, nullptr, 16));
+  }
+  return values;
+}
+
+static void print_packet(BleAdvEncoder * encoder, const BleAdvEncCmd & enc_cmd, const ControllerParam_t & cont) {
+  BleAdvEncCmd cmd = enc_cmd;
+  ControllerParam_t cp = cont;
+  BleAdvParam param;
+  encoder->encode(param, cmd, cp);
+  printf("packet;%s;%02X.%02X.%02X.%02X.%02X;%X.%X.%X.%X;%s\n", encoder->get_id().c_str(),
+         enc_cmd.cmd, enc_cmd.param1, enc_cmd.args[0], enc_cmd.args[1], enc_cmd.args[2],
+         cont.id_, cont.tx_count_, cont.index_, cont.seed_, host::to_hex(param.get_full_buf(), param.get_full_len()).c_str());
+}
+
+// the commands of the translators, plus raw commands with random args, with various controller parameters
+static int generate(BleAdvHandler & handler) {
+  std::mt19937 rng(42);
+  auto cmds = host::sample_commands();
+  for (auto & sample : esphome::HOST_RAW_SAMPLES) {
+    printf("sample;%s;%s\n", sample.id_, sample.raw_);
+  }
+  for (auto * encoder : host::get_host_encoders(handler)) {
+    for (auto & gen_cmd : cmds) {
+      BleAdvEncCmd enc_cmd;
+      if (!encoder->translate_g2e(enc_cmd, gen_cmd)) continue;
+      print_packet(encoder, enc_cmd, host::sample_controller(encoder, rng()));
+    }
+    for (size_t i = 0; i < 4; ++i) {
+      BleAdvEncCmd enc_cmd(rng());
+      enc_cmd.param1 = rng();
+      // args[2] is reserved to the pairing argument by the FanLamp v1 variants
+      enc_cmd.args[0] = rng();
+      enc_cmd.args[1] = rng();
+      print_packet(encoder, enc_cmd, host::sample_controller(encoder, rng()));
+    }
+  }
+  return 0;
+}
+
+// Decoded then re-encoded identically from the decoded command, as checked by identify_param:
+// only the data are compared, the samples being captured with other BLE parameters than the configured ones
+static void check_round_trip(BleAdvHandler & handler, BleAdvEncoder * encoder, BleAdvParam & param, size_t line_nb) {
+  BleAdvEncCmd enc_cmd;
+  ControllerParam_t cont;
+  HOST_CHECK(encoder->decode(param, enc_cmd, cont), "line %zu: not decoded by %s", line_nb, encoder->get_id().c_str());
+  BleAdvParam re_param;
+  encoder->encode(re_param, enc_cmd, cont);
+  std::string hex = host::to_hex(param.get_data_buf(), param.get_data_len());
+  std::string re_hex = host::to_hex(re_param.get_data_buf(), re_param.get_data_len());
+  HOST_CHECK(hex == re_hex, "line %zu: data re-encoded as %s", line_nb, re_hex.c_str());
+  HOST_CHECK(handler.identify_param(param, true), "line %zu: not identified", line_nb);
+}
+
+static int check(BleAdvHandler & handler, const char * corpus) {
+  std::ifstream file(corpus);
+  HOST_CHECK(file.good(), "cannot open %s", corpus);
+  std::string line;
+  size_t line_nb = 0;
+  size_t nb_packets = 0;
+  while (std::getline(file, line)) {
+    line_nb++;
+    auto fields = split(line, ';');
+    if (fields.empty()) continue;
+    BleAdvEncoder * encoder = (fields.size() > 1) ? handler.get_encoder(fields[1]) : nullptr;
+    HOST_CHECK(encoder != nullptr, "line %zu: unknown encoder", line_nb);
+    if (encoder == nullptr) continue;
+    BleAdvParam param = host::param_from_hex(fields.back());
+    nb_packets++;
+    if (fields[0] == "packet") {
+      auto cmd = parse_values(fields[2]);
+      auto cp = parse_values(fields[3]);
+      HOST_CHECK((cmd.size() == 5) && (cp.size() == 4), "line %zu: invalid command", line_nb);
+      if ((cmd.size() != 5) || (cp.size() != 4)) continue;
+      BleAdvEncCmd enc_cmd(cmd[0]);
+      enc_cmd.param1 = cmd[1];
+      enc_cmd.args[0] = cmd[2];
+      enc_cmd.args[1] = cmd[3];
+      enc_cmd.args[2] = cmd[4];
+      ControllerParam_t cont{cp[0], (uint8_t) cp[1], (uint8_t) cp[2], (uint16_t) cp[3]};
+      BleAdvParam enc_param;
+      encoder->encode(enc_param, enc_cmd, cont);
+      std::string enc_hex = host::to_hex(enc_param.get_full_buf(), enc_param.get_full_len());
+      HOST_CHECK(enc_hex == fields.back(), "line %zu: encoded as %s", line_nb, enc_hex.c_str());
+    }
+    check_round_trip(handler, encoder, param, line_nb);
+  }
+  printf("%zu golden packets checked\n", nb_packets);
+  HOST_CHECK(nb_packets > 0, "empty corpus");
+  return host::test_result();
+}
+
+int main(int argc, char ** argv) {
+  host::reset();
+  host::set_log_level(ESPHOME_LOG_LEVEL_WARN);
+  BleAdvHandler handler;
+  esphome::add_host_encoders(handler);
+  if ((argc > 1) && (strcmp(argv[1], "--generate") == 0)) {
+    return generate(handler);
+  }
+  return check(handler, (argc > 1) ? argv[1] : "golden/packets.txt");
+}
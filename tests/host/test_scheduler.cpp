@@ -0,0 +1,233 @@
+// Scheduler of the advertiser run against a mock of the BleAdvBackend interface, whatever its number of slots,
+// as the legacy and extended backends are only two implementations of it:
+//   - one request at a time per slot, a packet never on air on two slots at once
+//   - all the slots used, the airtime shared equally between the packets, and by weight between the controllers
+//   - a failing slot retried at the retry delay, the other slots going on
+
+#include "host_test.h"
+
+#include <map>
+#include <vector>
+
+using namespace host;
+
+static constexpr int64_t MS = 1000;
+
+// Slots completing their requests only when asked, the packets being identified by their first manufacturer data byte
+class MockBackend final: public BleAdvBackend
+{
+public:
+  explicit MockBackend(size_t nb_slots): slots_(nb_slots) {}
+
+  const char * get_name() const override { return "mock"; }
+  size_t get_nb_slots() const override { return this->slots_.size(); }
+
+  void advertise(size_t slot, BleAdvParam & param) override {
+    this->request(slot, Op::START);
+    this->slots_[slot].next_id_ = param.get_full_buf()[5];
+  }
+  void stop(size_t slot) override { this->request(slot, Op::STOP); }
+  void reset(size_t slot) override {
+    this->slots_[slot].pending_ = Op::NONE;
+    this->close(slot);
+  }
+
+  // completion of the request in progress on the slot given as instance
+  void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) override {
+    size_t index = param->ext_adv_data_set.instance;
+    bool success = (param->ext_adv_data_set.status == ESP_BT_STATUS_SUCCESS);
+    Slot & slot = this->slots_[index];
+    Op op = slot.pending_;
+    slot.pending_ = Op::NONE;
+    if (op == Op::START) {
+      if (success) this->open(index, slot.next_id_);
+      this->listener_->on_slot_started(index, success);
+    } else if (op == Op::STOP) {
+      this->close(index);
+      this->listener_->on_slot_stopped(index);
+    }
+  }
+
+  bool is_pending(size_t slot) const { return this->slots_[slot].pending_ != Op::NONE; }
+  int64_t get_airtime(uint8_t id) { return this->airtime_[id]; }
+  int64_t get_slot_airtime(size_t slot) const { return this->slots_[slot].airtime_; }
+  uint32_t get_nb_requests(size_t slot) const { return this->slots_[slot].nb_requests_; }
+
+  // contract violations
+  uint32_t nb_overlapping_{0}; // request issued while the previous one is in progress
+  uint32_t nb_duplicates_{0}; // packet on air on two slots at once
+
+  void close_all() {
+    for (size_t i = 0; i < this->slots_.size(); ++i) this->close(i);
+  }
+
+protected:
+  enum class Op: uint8_t { NONE, START, STOP };
+  struct Slot {
+    Op pending_{Op::NONE};
+    bool on_air_{false};
+    uint8_t id_{0};
+    uint8_t next_id_{0};
+    int64_t since_us_{0};
+    int64_t airtime_{0};
+    uint32_t nb_requests_{0};
+  };
+  std::vector< Slot > slots_;
+  std::map< uint8_t, int64_t > airtime_;
+
+  void request(size_t slot, Op op) {
+    if (this->slots_[slot].pending_ != Op::NONE) this->nb_overlapping_++;
+    this->slots_[slot].pending_ = op;
+    this->slots_[slot].nb_requests_++;
+  }
+
+  void open(size_t index, uint8_t id) {
+    this->close(index);
+    for (auto & other : this->slots_) {
+      if (other.on_air_ && (other.id_ == id)) this->nb_duplicates_++;
+    }
+    Slot & slot = this->slots_[index];
+    slot.on_air_ = true;
+    slot.id_ = id;
+    slot.since_us_ = now_us();
+  }
+
+  void close(size_t index) {
+    Slot & slot = this->slots_[index];
+    if (!slot.on_air_) return;
+    slot.on_air_ = false;
+    this->airtime_[slot.id_] += now_us() - slot.since_us_;
+    slot.airtime_ += now_us() - slot.since_us_;
+  }
+};
+
+struct Bench {
+  BleAdvHandler * handler_;
+  MockBackend * backend_;
+  size_t nb_slots_;
+  // slots completing their requests with a failure
+  std::vector< bool > failing_;
+};
+
+// Handlers never destroyed, as on the device
+static Bench make_bench(size_t nb_slots) {
+  host::reset();
+  Bench bench{new BleAdvHandler(), new MockBackend(nb_slots), nb_slots, std::vector< bool >(nb_slots, false)};
+  bench.handler_->set_backend(std::unique_ptr< BleAdvBackend >(bench.backend_));
+  bench.handler_->setup();
+  return bench;
+}
+
+static void handler_loop(void * arg) { static_cast< BleAdvHandler * >(arg)->loop(); }
+
+// The requests in progress complete at each ms
+static void run(Bench & bench, int64_t duration_ms) {
+  for (int64_t i = 0; i < duration_ms; ++i) {
+    run_for(1 * MS, handler_loop, bench.handler_);
+    for (size_t slot = 0; slot < bench.nb_slots_; ++slot) {
+      if (!bench.backend_->is_pending(slot)) continue;
+      esp_ble_gap_cb_param_t param{};
+      param.ext_adv_data_set.instance = slot;
+      param.ext_adv_data_set.status = bench.failing_[slot] ? ESP_BT_STATUS_FAIL : ESP_BT_STATUS_SUCCESS;
+      bench.handler_->gap_event_handler(ESP_GAP_BLE_EXT_ADV_DATA_SET_COMPLETE_EVT, &param);
+    }
+  }
+  bench.backend_->close_all();
+}
+
+static uint16_t advertise(Bench & bench, uint8_t id, size_t nb_packets, const esphome::EntityBase * owner = nullptr,
+                          uint8_t weight = 1) {
+  BleAdvParams params;
+  for (size_t i = 0; i < nb_packets; ++i) {
+    uint8_t raw[] = {0x02, 0x01, 0x1A, 0x05, 0xFF, (uint8_t)(id + i), 0x55, 0xAA, 0x00};
+    BleAdvParam * param = params.emplace_back();
+    param->from_raw(raw, sizeof(raw));
+  }
+  BleAdvSchedParam sched;
+  sched.cmd_type_ = CommandType::LIGHT_DIM;
+  sched.min_tx_duration_ = 100 * nb_packets;
+  sched.max_tx_duration_ = 3000;
+  sched.owner_ = owner;
+  sched.weight_ = weight;
+  return bench.handler_->add_to_advertiser(params, sched);
+}
+
+static void check_contract(Bench & bench) {
+  HOST_CHECK(bench.backend_->nb_overlapping_ == 0, "%u requests issued while one in progress",
+             bench.backend_->nb_overlapping_);
+  HOST_CHECK(bench.backend_->nb_duplicates_ == 0, "%u packets on air on two slots", bench.backend_->nb_duplicates_);
+}
+
+// 5 packets on the slots: all the slots busy, the airtime shared equally between the packets
+static void test_dispatch(size_t nb_slots) {
+  printf("dispatch, %zu slot(s)\n", nb_slots);
+  Bench bench = make_bench(nb_slots);
+  advertise(bench, 0x10, 3);
+  advertise(bench, 0x20, 2);
+  run(bench, 5000);
+  check_contract(bench);
+  int64_t total = 0;
+  for (size_t slot = 0; slot < nb_slots; ++slot) {
+    int64_t airtime = bench.backend_->get_slot_airtime(slot);
+    HOST_CHECK(airtime >= 5000 * MS * 95 / 100, "slot %zu on air for %lld us", slot, (long long)airtime);
+    total += airtime;
+  }
+  for (uint8_t id : {0x10, 0x11, 0x12, 0x20, 0x21}) {
+    int64_t airtime = bench.backend_->get_airtime(id);
+    HOST_CHECK(std::abs(airtime - total / 5) <= total / 50, "packet %02X on air for %lld us, expected %lld",
+               id, (long long)airtime, (long long)(total / 5));
+  }
+}
+
+// Controllers of weights 1, 2 and 3, one packet each, more than the slots: airtime shared in proportion
+static void test_weights(size_t nb_slots) {
+  printf("weights, %zu slot(s)\n", nb_slots);
+  static esphome::EntityBase owners[3];
+  Bench bench = make_bench(nb_slots);
+  for (uint8_t i = 0; i < 3; ++i) {
+    advertise(bench, 0x30 + 0x10 * i, 1, &owners[i], i + 1);
+  }
+  run(bench, 10000);
+  check_contract(bench);
+  int64_t total = 0;
+  for (uint8_t i = 0; i < 3; ++i) {
+    total += bench.backend_->get_airtime(0x30 + 0x10 * i);
+  }
+  for (uint8_t i = 0; i < 3; ++i) {
+    int64_t airtime = bench.backend_->get_airtime(0x30 + 0x10 * i);
+    int64_t expected = total * (i + 1) / 6;
+    HOST_CHECK(std::abs(airtime - expected) <= expected / 10, "weight %d on air for %lld us, expected %lld",
+               i + 1, (long long)airtime, (long long)expected);
+  }
+}
+
+// Slot 0 failing for 1s: retried at the retry delay, the other slots still advertising
+static void test_failing_slot(size_t nb_slots) {
+  printf("failing slot, %zu slot(s)\n", nb_slots);
+  Bench bench = make_bench(nb_slots);
+  bench.failing_[0] = true;
+  advertise(bench, 0x60, 4);
+  run(bench, 1000);
+  check_contract(bench);
+  HOST_CHECK(bench.backend_->get_nb_requests(0) <= 11, "%u requests on the failing slot in 1s",
+             bench.backend_->get_nb_requests(0));
+  HOST_CHECK(bench.backend_->get_slot_airtime(0) == 0, "failing slot on air");
+  for (size_t slot = 1; slot < nb_slots; ++slot) {
+    HOST_CHECK(bench.backend_->get_slot_airtime(slot) >= 950 * MS, "slot %zu on air for %lld us",
+               slot, (long long)bench.backend_->get_slot_airtime(slot));
+  }
+  bench.failing_[0] = false;
+  run(bench, 1000);
+  check_contract(bench);
+  HOST_CHECK(bench.backend_->get_slot_airtime(0) >= 850 * MS, "slot 0 on air for %lld us once recovered",
+             (long long)bench.backend_->get_slot_airtime(0));
+}
+
+int main() {
+  for (size_t nb_slots : {1, 2, 4}) {
+    test_dispatch(nb_slots);
+    if (nb_slots < 3) test_weights(nb_slots);
+    test_failing_slot(nb_slots);
+  }
+  return test_result();
+}
@@ -0,0 +1,92 @@
+// Equivalence of the generated translator dispatch tables with the flat if chains they replaced:
+// every translator is run on all the commands, and on all the combinations of the values compared by the conditions
+// of the translators plus values matching none of them, both in the generic to encoded and encoded to generic way.
+// Usage: test_translators
+
+#include "host_test.h"
+
+#include <vector>
+
+using namespace esphome::ble_adv_handler;
+
+// values not compared by any condition, to check the fall through and the translators computing args
+static constexpr float G_EXTRA_VALUES[] = { 0.25f, 0.5f, 0.8f, 9, 10, 100 };
+static constexpr uint8_t E_EXTRA_VALUES[] = { 6, 100, 128, 200 };
+
+// the first differences are enough to diagnose, stop there
+static constexpr int MAX_FAILURES = 20;
+
+static bool same_enc(const BleAdvEncCmd & cmd1, const BleAdvEncCmd & cmd2) {
+  return (cmd1.cmd == cmd2.cmd) && (cmd1.param1 == cmd2.param1) && std::equal(cmd1.args, cmd1.args + 3, cmd2.args);
+}
+
+static bool same_gen(const BleAdvGenCmd & cmd1, const BleAdvGenCmd & cmd2) {
+  return (cmd1.cmd == cmd2.cmd) && (cmd1.param == cmd2.param) && std::equal(cmd1.args, cmd1.args + 2, cmd2.args);
+}
+
+static size_t check_g2e(const esphome::HostTranslatorPair & pair, const std::vector< float > & values) {
+  size_t nb_cases = 0;
+  for (int cmd = 0; (cmd < 64) && (host::nb_failures < MAX_FAILURES); ++cmd) {
+    for (float param : values) {
+      for (float arg0 : values) {
+        for (float arg1 : values) {
+          BleAdvGenCmd gen_cmd((CommandType) cmd);
+          gen_cmd.param = (uint8_t) param;
+          gen_cmd.args[0] = arg0;
+          gen_cmd.args[1] = arg1;
+          BleAdvEncCmd enc_cmd;
+          BleAdvEncCmd ref_cmd;
+          pair.translator_->g2e_cmd(gen_cmd, enc_cmd);
+          pair.reference_->g2e_cmd(gen_cmd, ref_cmd);
+          HOST_CHECK(same_enc(enc_cmd, ref_cmd), "%s g2e: %d.%d.%g.%g gives %02X.%02X.%02X.%02X.%02X instead of %02X.%02X.%02X.%02X.%02X",
+                     pair.name_, cmd, gen_cmd.param, arg0, arg1, enc_cmd.cmd, enc_cmd.param1, enc_cmd.args[0], enc_cmd.args[1], enc_cmd.args[2],
+                     ref_cmd.cmd, ref_cmd.param1, ref_cmd.args[0], ref_cmd.args[1], ref_cmd.args[2]);
+          ++nb_cases;
+        }
+      }
+    }
+  }
+  return nb_cases;
+}
+
+static size_t check_e2g(const esphome::HostTranslatorPair & pair, const std::vector< uint8_t > & values) {
+  size_t nb_cases = 0;
+  for (int cmd = 0; (cmd < 256) && (host::nb_failures < MAX_FAILURES); ++cmd) {
+    for (uint8_t param1 : values) {
+      for (uint8_t arg0 : values) {
+        for (uint8_t arg1 : values) {
+          for (uint8_t arg2 : values) {
+            BleAdvEncCmd enc_cmd(cmd);
+            enc_cmd.param1 = param1;
+            enc_cmd.args[0] = arg0;
+            enc_cmd.args[1] = arg1;
+            enc_cmd.args[2] = arg2;
+            BleAdvGenCmd gen_cmd;
+            BleAdvGenCmd ref_cmd;
+            pair.translator_->e2g_cmd(enc_cmd, gen_cmd);
+            pair.reference_->e2g_cmd(enc_cmd, ref_cmd);
+            HOST_CHECK(same_gen(gen_cmd, ref_cmd), "%s e2g: %02X.%02X.%02X.%02X.%02X gives %d.%d.%g.%g instead of %d.%d.%g.%g",
+                       pair.name_, cmd, param1, arg0, arg1, arg2, gen_cmd.cmd, gen_cmd.param, gen_cmd.args[0], gen_cmd.args[1],
+                       ref_cmd.cmd, ref_cmd.param, ref_cmd.args[0], ref_cmd.args[1]);
+            ++nb_cases;
+          }
+        }
+      }
+    }
+  }
+  return nb_cases;
+}
+
+int main() {
+  std::vector< float > g_values(std::begin(esphome::HOST_TRANSLATOR_G_VALUES), std::end(esphome::HOST_TRANSLATOR_G_VALUES));
+  g_values.insert(g_values.end(), std::begin(G_EXTRA_VALUES), std::end(G_EXTRA_VALUES));
+  std::vector< uint8_t > e_values(std::begin(esphome::HOST_TRANSLATOR_E_VALUES), std::end(esphome::HOST_TRANSLATOR_E_VALUES));
+  e_values.insert(e_values.end(), std::begin(E_EXTRA_VALUES), std::end(E_EXTRA_VALUES));
+
+  for (auto & pair : esphome::HOST_TRANSLATORS) {
+    size_t nb_g2e = check_g2e(pair, g_values);
+    size_t nb_e2g = check_e2g(pair, e_values);
+    printf("%-22s %10zu g2e %10zu e2g\n", pair.name_, nb_g2e, nb_e2g);
+  }
+  return host::test_result();
+}